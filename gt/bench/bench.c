@@ -0,0 +1,206 @@
+/*
+    Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
+
+    Benchmark for the patcher.
+
+        bench.elf gen <functions> <directory>
+            writes C sources with <functions> patchable functions, split in
+            files of BENCH_FILE_FUNCTIONS functions so they can be compiled
+            in parallel.
+
+        bench.elf run <elf> <entrypoint> [repeat]
+            times elf_load_elf, elf_get_sym_wname, elf_patch_elf and
+            elf_save_elf on <elf>, one JSON object per line:
+            {"bench":"<phase>","elf":"<elf>","functions":<n>,"repeat":<r>,"min_ns":<ns>,"median_ns":<ns>}
+*/
+
+#include "../src/lib.h"
+#include "../src/patch.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FILE_FUNCTIONS 10000
+#define BENCH_MAX_REPEAT 64
+
+enum {
+    BENCH_LOAD,
+    BENCH_LOOKUP,
+    BENCH_PATCH,
+    BENCH_SAVE,
+    BENCH_NUM
+};
+
+static const char* const bench_names[BENCH_NUM] = {
+    "elf_load_elf",
+    "elf_get_sym_wname",
+    "elf_patch_elf",
+    "elf_save_elf",
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_gen(size_t functions, const char* directory)
+{
+    char path[PATH_MAX];
+    if (mkdir(directory, 0755) != 0 && access(directory, W_OK) != 0) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    for (size_t first = 0; first < functions; first += BENCH_FILE_FUNCTIONS) {
+        snprintf(path, sizeof(path), "%s/bench_%07zu.c", directory, first / BENCH_FILE_FUNCTIONS);
+        FILE* file = fopen(path, "w");
+        if (file == NULL) {
+            return elf_stack_error(ELF_ERR_PATH);
+        }
+
+        size_t last = (first + BENCH_FILE_FUNCTIONS < functions) ? first + BENCH_FILE_FUNCTIONS : functions;
+        for (size_t i = first; i < last; i++) {
+            fprintf(file, "int bench_fn_%zu(int x) { return x * %zu + 1; }\n", i, i);
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "%s/bench_main.c", directory);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    fprintf(file, "int bench_fn_0(int x);\n");
+    fprintf(file, "int gt_test_main() { return 0; }\n");
+    fprintf(file, "int main(int argc, char** argv) { return bench_fn_0(argc) & 0; }\n");
+    fclose(file);
+    return elf_stack_error(ELF_OK);
+}
+
+static int bench_run_once(const char* path, const char* entrypoint, const char* output, char** names, size_t functions, uint64_t* times)
+{
+    uint64_t start = bench_now();
+    elf_check(elf_load_elf(path));
+    times[BENCH_LOAD] = bench_now() - start;
+
+    // the first lookup builds the symbol index, it is part of the cost.
+    Elf64_Shdr* symtab;
+    Elf64_Sym* sym;
+    start = bench_now();
+    elf_check(elf_get_sym_shdr(&symtab));
+    for (size_t i = 0; i < functions; i++) {
+        elf_check(elf_get_sym_wname(symtab, names[i], &sym));
+    }
+    times[BENCH_LOOKUP] = (functions) ? (bench_now() - start) / functions : 0;
+
+    // elf_patch_elf reports on stdout, which carries the results.
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    start = bench_now();
+    int error = elf_patch_elf(entrypoint, 0);
+    times[BENCH_PATCH] = bench_now() - start;
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    elf_check(error);
+
+    start = bench_now();
+    elf_check(elf_save_elf(output));
+    times[BENCH_SAVE] = bench_now() - start;
+
+    unlink(output);
+    elf_check(elf_unload_elf());
+    return elf_stack_error(ELF_OK);
+}
+
+static int bench_run(const char* path, const char* entrypoint, size_t repeat)
+{
+    // names are looked up the way the patcher and the cli do, one at a time.
+    elf_check(elf_load_elf(path));
+    const elf_func_table* table;
+    elf_check(elf_get_func_table(&table));
+
+    size_t functions = table->length;
+    char** names = malloc(functions * sizeof(*names));
+    if (names == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+    for (size_t i = 0; i < functions; i++) {
+        names[i] = strdup(table->name[i]);
+    }
+    elf_check(elf_unload_elf());
+
+    char output[PATH_MAX];
+    snprintf(output, sizeof(output), "%s.bench-out", path);
+
+    uint64_t times[BENCH_NUM][BENCH_MAX_REPEAT];
+    for (size_t r = 0; r < repeat; r++) {
+        uint64_t once[BENCH_NUM];
+        elf_check(bench_run_once(path, entrypoint, output, names, functions, once));
+        for (size_t b = 0; b < BENCH_NUM; b++) {
+            times[b][r] = once[b];
+        }
+    }
+
+    for (size_t b = 0; b < BENCH_NUM; b++) {
+        qsort(times[b], repeat, sizeof(uint64_t), bench_compare);
+        printf("{\"bench\":\"%s\",\"elf\":\"%s\",\"functions\":%zu,\"repeat\":%zu,\"min_ns\":%lu,\"median_ns\":%lu}\n",
+            bench_names[b], path, functions, repeat, times[b][0], times[b][repeat / 2]);
+    }
+
+    for (size_t i = 0; i < functions; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return elf_stack_error(ELF_OK);
+}
+
+static int bench_number(const char* text, long* number)
+{
+    char* end;
+    *number = strtol(text, &end, 10);
+    return (*text != '\0' && *end == '\0' && *number >= 0) ? ELF_OK : ELF_ERR_NOT_NUMBER;
+}
+
+int main(int argc, char** argv)
+{
+    long number = 0;
+    if (argc == 4 && strcmp(argv[1], "gen") == 0 && bench_number(argv[2], &number) == ELF_OK) {
+        if (bench_gen(number, argv[3]) != ELF_OK) {
+            elf_print_error_trace();
+            return 1;
+        }
+        return 0;
+    }
+
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "run") == 0) {
+        long repeat = 5;
+        if (argc == 5 && (bench_number(argv[4], &repeat) != ELF_OK || repeat < 1 || repeat > BENCH_MAX_REPEAT)) {
+            puts("bench: repeat must be between 1 and 64.");
+            return 1;
+        }
+        if (bench_run(argv[2], argv[3], repeat) != ELF_OK) {
+            elf_print_error_trace();
+            return 1;
+        }
+        return 0;
+    }
+
+    puts("bench: gen <functions> <directory>, run <elf> <entrypoint> [repeat]");
+    return 1;
+}
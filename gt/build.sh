@@ -6,11 +6,13 @@ output_cli="cli.elf"
 output_gt="gt.o"
 output_demo="demo.elf"
 output_lib="libgt.a"
+output_bench="bench.elf"
+bench_sizes=${GT_BENCH_SIZES:-"1000 10000 100000"}
 
 function build_cli {
     local outputfile=$output_cli
     local srcfiles="$(find src -name "*.c" -printf '%p ')"
-    local command="gcc -o $outputfile $srcfiles -ggdb -Werror -Wreturn-type"
+    local command="gcc -o $outputfile ${srcfiles/'src/self.c'/''} -ggdb -Werror -Wreturn-type -pthread -lm"
     echo $command
     $command
     if [ $? -eq 0 ]
@@ -43,7 +45,7 @@ function build_demo {
     fi
     local outputfile=$output_demo
     local demofiles=" $(find demo -name "*.c" -printf '%p ') $output_gt"
-    local command="gcc -o $outputfile $demofiles -ggdb -Werror -Wreturn-type -fpatchable-function-entry=50 -lm -lc -fno-stack-protector"
+    local command="gcc -o $outputfile $demofiles -ggdb -Werror -Wreturn-type -fpatchable-function-entry=50 -lm -lc -fno-stack-protector -pthread"
     echo $command
     $command
     if [ $? -eq 0 ]
@@ -69,6 +71,32 @@ function build_lib {
     return 1
 }
 
+function build_bench {
+    if [ ! -f "$output_gt" ]
+    then build_gt
+    fi
+    local outputfile=$output_bench
+    local srcfiles="$(find src -name "*.c" -printf '%p ')"
+    srcfiles=${srcfiles/'src/cli.c'/''}
+    local command="gcc -o $outputfile bench/bench.c ${srcfiles/'src/self.c'/''} -O2 -ggdb -Werror -Wreturn-type -pthread -lm"
+    echo $command
+    $command || return 1
+    chmod +x $outputfile
+    echo "  Output: $outputfile"
+
+    for size in $bench_sizes
+    do
+        local benchdir="bench/build/$size"
+        mkdir -p "$benchdir"
+        ./$outputfile gen $size $benchdir || return 1
+        echo "  Compiling $size functions in $benchdir"
+        find $benchdir -name "*.c" -print0 | xargs -0 -P "$(nproc)" -I{} gcc -c {} -o {}.o -fpatchable-function-entry=50 || return 1
+        gcc -o $benchdir/bench.elf $benchdir/*.o $output_gt -lm -pthread || return 1
+        ./$outputfile run $benchdir/bench.elf main || return 1
+    done
+    return 0
+}
+
 function build_all {
     build_cli
     build_gt
@@ -82,8 +110,37 @@ function build_test {
     fi
     build_gt
     build_demo
-    ./cli.elf elf demo.elf patch main
-    ./out
+    ./cli.elf elf demo.elf patch main || return 1
+    # null_vector fails on purpose, to show how a failure is reported.
+    ./out || echo "  out: some test cases failed"
+}
+
+function build_diff {
+    if [ ! -f "$output_cli" ]
+    then build_cli
+    fi
+    build_gt || return 1
+    build_demo || return 1
+
+    # a function linked before the demo moves all of its code; only the new
+    # function may be reported by the diff.
+    local shifteddir=$(mktemp -d)
+    local outputfile="$shifteddir/$output_demo"
+    echo "int gt_inserted_function(int x) { return x + 1; }" > "$shifteddir/inserted.c"
+    local demofiles="$shifteddir/inserted.c $(find demo -name "*.c" -printf '%p ') $output_gt"
+    local command="gcc -o $outputfile $demofiles -ggdb -Werror -Wreturn-type -fpatchable-function-entry=50 -lm -lc -fno-stack-protector -pthread"
+    echo $command
+    $command || { rm -r "$shifteddir"; return 1; }
+
+    local report=$(./$output_cli diff $output_demo $outputfile)
+    rm -r "$shifteddir"
+    echo "$report"
+    if [[ "$report" != *$'\nChanged: 0\nAdded: 1\nRemoved: 0\n'* ]]
+    then
+        echo "  diff: moved functions were reported as changed"
+        return 1
+    fi
+    return 0
 }
 
 declare -A artefacts=(
@@ -93,6 +150,8 @@ declare -A artefacts=(
     ["lib"]="build_lib"
     ["all"]="build_all"
     ["test"]="build_test"
+    ["diff"]="build_diff"
+    ["bench"]="build_bench"
 )
 
 if [[ $# -ne 1 ]]; then
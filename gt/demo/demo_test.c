@@ -20,6 +20,79 @@ vector GT_MOCK_OF(normalise_vector)(vector vector_1)
     return data->retval;
 }
 
+GT_STRUCT_OF(null_vector)
+{
+    vector retval;
+    vector_type provided;
+    int called;
+};
+
+vector GT_MOCK_OF(null_vector)(vector_type type)
+{
+    GT_STRUCT_OF(null_vector)* data = gt_get_data(null_vector);
+    data->provided = type;
+    data->called++;
+    return data->retval;
+}
+
+// calls null_vector with a marker in every callee-saved register, then
+// returns how many of them still hold their marker.
+int count_kept_registers(vector* retval, vector_type type);
+__asm__(
+    "    .pushsection .text\n"
+    "    .globl count_kept_registers\n"
+    "    .type count_kept_registers, @function\n"
+    "count_kept_registers:\n"
+    "    push %rbx\n"
+    "    push %rbp\n"
+    "    push %r12\n"
+    "    push %r13\n"
+    "    push %r14\n"
+    "    push %r15\n"
+    "    sub $8, %rsp\n"
+    "    movabs $0x6774000000000001, %rbx\n"
+    "    movabs $0x6774000000000002, %rbp\n"
+    "    movabs $0x6774000000000003, %r12\n"
+    "    movabs $0x6774000000000004, %r13\n"
+    "    movabs $0x6774000000000005, %r14\n"
+    "    movabs $0x6774000000000006, %r15\n"
+    "    call null_vector\n"
+    "    xor %eax, %eax\n"
+    "    movabs $0x6774000000000001, %rcx\n"
+    "    cmp %rcx, %rbx\n"
+    "    sete %dl\n"
+    "    add %dl, %al\n"
+    "    inc %rcx\n"
+    "    cmp %rcx, %rbp\n"
+    "    sete %dl\n"
+    "    add %dl, %al\n"
+    "    inc %rcx\n"
+    "    cmp %rcx, %r12\n"
+    "    sete %dl\n"
+    "    add %dl, %al\n"
+    "    inc %rcx\n"
+    "    cmp %rcx, %r13\n"
+    "    sete %dl\n"
+    "    add %dl, %al\n"
+    "    inc %rcx\n"
+    "    cmp %rcx, %r14\n"
+    "    sete %dl\n"
+    "    add %dl, %al\n"
+    "    inc %rcx\n"
+    "    cmp %rcx, %r15\n"
+    "    sete %dl\n"
+    "    add %dl, %al\n"
+    "    add $8, %rsp\n"
+    "    pop %r15\n"
+    "    pop %r14\n"
+    "    pop %r13\n"
+    "    pop %r12\n"
+    "    pop %rbp\n"
+    "    pop %rbx\n"
+    "    ret\n"
+    "    .size count_kept_registers, .-count_kept_registers\n"
+    "    .popsection\n");
+
 // entry point
 int gt_test_main()
 {
@@ -49,6 +122,77 @@ int gt_test_main()
             gt_assert(r.type, GT_MODE_EQUAL, VECTOR_TYPE_3D);
             gt_assert(r.x, GT_MODE_EQUAL, 0.f);
         }
+
+        gt_test_case(arguments_on_stack)
+        {
+            // arrange
+            GT_STRUCT_OF(normalise_vector)
+            data = {
+                .called = 0,
+                .retval = { .x = 1.f, .type = VECTOR_TYPE_2D },
+            };
+
+            gt_set_mock(normalise_vector, &data);
+            vector v = { .x = 3.f, .y = 4.f, .type = VECTOR_TYPE_2D };
+
+            // act
+            vector r = normalise_vector(v);
+
+            // assert
+            gt_assert(data.called, GT_MODE_EQUAL, 1);
+            gt_assert(data.provided.x, GT_MODE_EQUAL, 3.f);
+            gt_assert(data.provided.y, GT_MODE_EQUAL, 4.f);
+            gt_assert(data.provided.type, GT_MODE_EQUAL, VECTOR_TYPE_2D);
+            gt_assert(r.x, GT_MODE_EQUAL, 1.f);
+        }
+    }
+
+    gt_test_function(null_vector)
+    {
+        gt_test_case(callee_saved_registers)
+        {
+            // arrange
+            GT_STRUCT_OF(null_vector)
+            data = {
+                .called = 0,
+                .retval = { .type = VECTOR_TYPE_4D },
+            };
+
+            gt_set_mock(null_vector, &data);
+            vector r = { .type = VECTOR_TYPE_INV };
+
+            // act
+            int kept = count_kept_registers(&r, VECTOR_TYPE_2D);
+
+            // assert
+            gt_assert(kept, GT_MODE_EQUAL, 6);
+            gt_assert(data.called, GT_MODE_EQUAL, 1);
+            gt_assert(data.provided, GT_MODE_EQUAL, VECTOR_TYPE_2D);
+            gt_assert(r.type, GT_MODE_EQUAL, VECTOR_TYPE_4D);
+        }
+    }
+
+    gt_test_function(vector_math)
+    {
+        vector a = { .x = 1.f, .y = 2.f, .z = 3.f, .w = 4.f, .type = VECTOR_TYPE_4D };
+        vector b = { .x = 4.f, .y = 3.f, .z = 2.f, .w = 1.f, .type = VECTOR_TYPE_4D };
+        gt_do_not_optimize(&a);
+        gt_do_not_optimize(&b);
+
+        gt_bench(dotp_vectors)
+        {
+            gt_do_not_optimize(dotp_vectors(a, b));
+        }
+
+        gt_bench(get_vector_norm)
+        {
+            gt_do_not_optimize(get_vector_norm(a));
+        }
+
+        gt_bench(normalise_vector)
+        {
+            gt_do_not_optimize(normalise_vector(a));
+        }
     }
-    return 0;
+    return gt_exit_status();
 }
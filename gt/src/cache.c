@@ -0,0 +1,231 @@
+/*
+    Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
+
+    Content-addressed cache of patched executables.
+
+    An entry is named after a hash of the input file, the entry point name
+    and the patch layout version; it holds the patched output. Entries are
+    reflinked or hardlinked into place, and the least recently used ones
+    are deleted when the cache grows over its size limit.
+*/
+
+#define _GNU_SOURCE
+#include "cache.h"
+#include "lib.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ELF_CACHE_NAME_SIZE (ELF_CACHE_KEY_SIZE + sizeof(ELF_CACHE_SIDECAR))
+
+typedef struct {
+    char name[ELF_CACHE_NAME_SIZE];
+    off_t size;
+    struct timespec used;
+} elf_cache_entry;
+
+int elf_cache_key(const char* input, const char* entry, uint32_t version, char* key_ref)
+{
+    if (input == NULL || entry == NULL || key_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    int fd = open(input, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    // the entry point and layout version seed the hash of the file.
+    uint64_t seed[2];
+    elf_hash_bytes(entry, strlen(entry), version, seed);
+
+    uint64_t hash[2];
+    elf_hash_bytes(data, st.st_size, seed[0] ^ seed[1], hash);
+    munmap(data, st.st_size);
+
+    snprintf(key_ref, ELF_CACHE_KEY_SIZE, "%016lx%016lx", hash[0], hash[1]);
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_cache_clone(const char* source, const char* destination)
+{
+    // published with rename, a reader sees the old file or the whole new one.
+    char temp[PATH_MAX];
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", destination) >= (int)sizeof(temp)) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    int src_fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    struct stat st;
+    int dst_fd = mkstemp(temp);
+    if (dst_fd < 0 || fstat(src_fd, &st) != 0) {
+        if (dst_fd >= 0) {
+            close(dst_fd);
+            unlink(temp);
+        }
+        close(src_fd);
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    // reflink, else hardlink, else copy.
+    int error = ELF_OK;
+    if (ioctl(dst_fd, FICLONE, src_fd) != 0) {
+        // the empty temp file must go, or it would be published as the output.
+        if (unlink(temp) != 0) {
+            error = ELF_ERR_WRITE;
+        } else if (link(source, temp) != 0) {
+            int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+            close(dst_fd);
+            dst_fd = open(temp, flags, 0600);
+            error = (dst_fd < 0) ? ELF_ERR_PATH : elf_copy_fd(src_fd, dst_fd, st.st_size);
+        }
+    }
+
+    if (error == ELF_OK && dst_fd >= 0 && fchmod(dst_fd, st.st_mode & 07777) != 0) {
+        error = ELF_ERR_WRITE;
+    }
+    if (dst_fd >= 0) {
+        close(dst_fd);
+    }
+    close(src_fd);
+
+    if (error == ELF_OK && rename(temp, destination) != 0) {
+        error = ELF_ERR_WRITE;
+    }
+
+    // renaming a hardlink over the same file succeeds without removing it.
+    unlink(temp);
+    if (error != ELF_OK) {
+        return elf_stack_error(error);
+    }
+
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_cache_fetch(const char* directory, const char* key, const char* output)
+{
+    if (directory == NULL || key == NULL || output == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, key);
+    if (access(path, R_OK) != 0) {
+        return elf_stack_error(ELF_ERR_NOT_FOUND);
+    }
+
+    elf_check(elf_cache_clone(path, output));
+
+    // the modification time orders entries for eviction.
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_cache_compare_used(const void* a, const void* b)
+{
+    const elf_cache_entry* x = a;
+    const elf_cache_entry* y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return (x->used.tv_sec > y->used.tv_sec) - (x->used.tv_sec < y->used.tv_sec);
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+static int elf_cache_evict(const char* directory, size_t max_size)
+{
+    DIR* dir = opendir(directory);
+    if (dir == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    elf_cache_entry* entries = NULL;
+    size_t entry_num = 0;
+    size_t entry_max = 0;
+    size_t total = 0;
+
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat st;
+        // temporary files being published are left alone.
+        const char* suffix = dirent->d_name + ELF_CACHE_KEY_SIZE - 1;
+        if (strspn(dirent->d_name, "0123456789abcdef") != ELF_CACHE_KEY_SIZE - 1
+            || (*suffix != '\0' && strcmp(suffix, ELF_CACHE_SIDECAR) != 0)
+            || fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (entry_num == entry_max) {
+            entry_max = (entry_max) ? entry_max * 2 : 64;
+            elf_cache_entry* grown = realloc(entries, entry_max * sizeof(*entries));
+            if (grown == NULL) {
+                free(entries);
+                closedir(dir);
+                return elf_stack_error(ELF_ERR_MALLOC);
+            }
+            entries = grown;
+        }
+
+        elf_cache_entry* entry = &entries[entry_num++];
+        strcpy(entry->name, dirent->d_name);
+        entry->size = st.st_size;
+        entry->used = st.st_mtim;
+        total += st.st_size;
+    }
+
+    // least recently used first, until the cache fits.
+    qsort(entries, entry_num, sizeof(*entries), elf_cache_compare_used);
+    for (size_t i = 0; i < entry_num && total > max_size; i++) {
+        if (unlinkat(dirfd(dir), entries[i].name, 0) == 0 || errno == ENOENT) {
+            total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+    closedir(dir);
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_cache_store(const char* directory, const char* key, const char* output, size_t max_size)
+{
+    if (directory == NULL || key == NULL || output == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, key);
+    elf_check(elf_cache_clone(output, path));
+    elf_check(elf_cache_evict(directory, max_size));
+    return elf_stack_error(ELF_OK);
+}
@@ -0,0 +1,18 @@
+/*
+    Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define ELF_CACHE_KEY_SIZE 33
+
+// an entry may have one sidecar file, named after its key and this suffix.
+#define ELF_CACHE_SIDECAR ".gtm"
+
+int elf_cache_key(const char* input, const char* entry, uint32_t version, char* key_ref);
+
+int elf_cache_fetch(const char* directory, const char* key, const char* output);
+
+int elf_cache_store(const char* directory, const char* key, const char* output, size_t max_size);
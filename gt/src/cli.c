@@ -2,13 +2,47 @@
     Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
 */
 
+#include "cache.h"
 #include "lib.h"
+#include "manifest.h"
 #include "patch.h"
+#include "utils.h"
 #include <elf.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#define CMD_BATCH_MAX_JOBS 256
+#define CMD_CACHE_DEFAULT_SIZE 1024
+
+typedef struct {
+    const char* directory;
+    size_t max_size;
+} cmd_cache;
+
+typedef struct {
+    const char* input;
+    const char* output;
+    elf_patch_stats stats;
+    uint64_t load_ns;
+    uint64_t patch_ns;
+    uint64_t save_ns;
+    int cached;
+    int error;
+} cmd_batch_file;
+
+typedef struct {
+    cmd_batch_file* files;
+    size_t length;
+    size_t next;
+    const char* entry;
+    elf_patch_mode mode;
+    cmd_cache cache;
+} cmd_batch_queue;
 
 void check(int result)
 {
@@ -33,25 +67,15 @@ int cmd_elf_header(const char* filename)
 int cmd_elf_funclist(const char* filename)
 {
     check(elf_load_elf(filename));
-    elf_index_iterator it;
-    Elf64_Shdr* symtabsh;
-    Elf64_Shdr* strsh;
-    const char* name;
-    Elf64_Sym* sym;
-    int error;
+    const elf_func_table* table;
 
-    elf_check(elf_get_sym_shdr(&symtabsh));
-    elf_check(elf_get_sym_strtab_shdr(symtabsh, &strsh));
-    elf_check(elf_reset_index_iterator(&it));
-    while ((error = elf_get_sym_wtype(symtabsh, STT_FUNC, &it) == ELF_OK)) {
-        sym = it.object;
-        uint8_t sym_visibility = ELF64_ST_VISIBILITY(sym->st_other);
+    elf_check(elf_get_func_table(&table));
+    for (size_t i = 0; i < table->length; i++) {
+        uint8_t sym_visibility = ELF64_ST_VISIBILITY(table->symbol[i]->st_other);
         if (sym_visibility != STV_HIDDEN) {
-            elf_check(elf_get_strtab_shdr_text(strsh, sym->st_name, &name));
-            printf("%s\n", name);
+            printf("%s\n", table->name[i]);
         }
     }
-    elf_check(error);
     elf_check(elf_unload_elf());
     return elf_stack_error(ELF_OK);
 }
@@ -77,14 +101,119 @@ int cmd_elf_func(int argc, char** argv, const char* filename)
     }
 }
 
+// GT_CACHE_DIR enables the patch cache, GT_CACHE_SIZE bounds it in MiB.
+static int cmd_cache_config(cmd_cache* cache)
+{
+    cache->directory = getenv("GT_CACHE_DIR");
+    cache->max_size = (size_t)CMD_CACHE_DEFAULT_SIZE << 20;
+
+    const char* size = getenv("GT_CACHE_SIZE");
+    if (cache->directory != NULL && size != NULL) {
+        char* end;
+        long mib = strtol(size, &end, 10);
+        if (*end != '\0' || mib < 0) {
+            puts("GT_CACHE_SIZE: expected a size in MiB.");
+            return elf_stack_error(ELF_ERR_NOT_NUMBER);
+        }
+        cache->max_size = (size_t)mib << 20;
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+// the function manifest of an output is saved next to it.
+static int cmd_sidecar_path(const char* output, char* path_ref, size_t size)
+{
+    if ((size_t)snprintf(path_ref, size, "%s" ELF_CACHE_SIDECAR, output) >= size) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+static int cmd_cache_fetch(const cmd_cache* cache, const char* key, const char* output)
+{
+    char sidecar_key[ELF_CACHE_KEY_SIZE + sizeof(ELF_CACHE_SIDECAR)];
+    char sidecar[PATH_MAX];
+    snprintf(sidecar_key, sizeof(sidecar_key), "%s" ELF_CACHE_SIDECAR, key);
+    elf_check(cmd_sidecar_path(output, sidecar, sizeof(sidecar)));
+
+    elf_check(elf_cache_fetch(cache->directory, key, output));
+    elf_check(elf_cache_fetch(cache->directory, sidecar_key, sidecar));
+    return elf_stack_error(ELF_OK);
+}
+
+static int cmd_cache_store(const cmd_cache* cache, const char* key, const char* output)
+{
+    char sidecar_key[ELF_CACHE_KEY_SIZE + sizeof(ELF_CACHE_SIDECAR)];
+    char sidecar[PATH_MAX];
+    snprintf(sidecar_key, sizeof(sidecar_key), "%s" ELF_CACHE_SIDECAR, key);
+    elf_check(cmd_sidecar_path(output, sidecar, sizeof(sidecar)));
+
+    elf_check(elf_cache_store(cache->directory, sidecar_key, sidecar, cache->max_size));
+    elf_check(elf_cache_store(cache->directory, key, output, cache->max_size));
+    return elf_stack_error(ELF_OK);
+}
+
+// saves the patched elf and its function manifest.
+static int cmd_save_outputs(const char* output, elf_manifest* manifest)
+{
+    char sidecar[PATH_MAX];
+    int error = cmd_sidecar_path(output, sidecar, sizeof(sidecar));
+    if (error == ELF_OK) {
+        error = elf_save_elf(output);
+    }
+    if (error == ELF_OK) {
+        error = elf_save_manifest(sidecar, manifest);
+    }
+
+    elf_free_manifest(manifest);
+    return elf_stack_error(error);
+}
+
+// GT_PATCH_MODE selects how functions are patched, inline by default.
+static int cmd_patch_mode(elf_patch_mode* mode_ref)
+{
+    if (elf_patch_mode_wname(getenv("GT_PATCH_MODE"), mode_ref) != ELF_OK) {
+        puts("GT_PATCH_MODE: expected inline, compact or prefix.");
+        return elf_stack_error(ELF_ERR_OPTION);
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+// outputs of different modes, and manifests of different versions, are cached apart.
+static uint32_t cmd_cache_version(elf_patch_mode mode)
+{
+    return (ELF_MANIFEST_VERSION << 16) | (ELF_PATCH_LAYOUT_VERSION << 8) | mode;
+}
+
 int cmd_elf_patch(const char* filename, const char* entry, const char* verbose)
 {
-    int verbose_enabled = (verbose != NULL && strcmp(verbose, "verbose") == 0);
+    elf_patch_options options = { .verbose = (verbose != NULL && strcmp(verbose, "verbose") == 0) };
+    elf_check(cmd_patch_mode(&options.mode));
+
+    cmd_cache cache;
+    char key[ELF_CACHE_KEY_SIZE];
+    elf_check(cmd_cache_config(&cache));
+    if (cache.directory != NULL) {
+        elf_check(elf_cache_key(filename, entry, cmd_cache_version(options.mode), key));
+
+        // a verbose run is asked for its listing, so it always patches.
+        if (!options.verbose && cmd_cache_fetch(&cache, key, "out") == ELF_OK) {
+            printf("Cached: %s\n", key);
+            return elf_stack_error(ELF_OK);
+        }
+    }
 
+    elf_patch_stats stats;
+    elf_manifest manifest;
     elf_check(elf_load_elf(filename));
-    elf_check(elf_patch_elf(entry, verbose_enabled));
-    elf_check(elf_save_elf("out"));
+    elf_check(elf_patch_elf_woptions(entry, &options, &stats, &manifest));
+    elf_check(cmd_save_outputs("out", &manifest));
     elf_check(elf_unload_elf());
+    printf("\n\nPatched: %zu\nSkipped: %zu\n", stats.patched, stats.skipped);
+
+    if (cache.directory != NULL) {
+        elf_check(cmd_cache_store(&cache, key, "out"));
+    }
     return elf_stack_error(ELF_OK);
 }
 
@@ -124,6 +253,317 @@ int cmd_elf_section(const char* filename)
     return elf_stack_error(ELF_OK);
 }
 
+static uint64_t cmd_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmd_batch_patch(cmd_batch_file* file, const cmd_batch_queue* queue)
+{
+    const cmd_cache* cache = &queue->cache;
+    char key[ELF_CACHE_KEY_SIZE];
+    uint64_t start = cmd_now();
+    if (cache->directory != NULL) {
+        elf_check(elf_cache_key(file->input, queue->entry, cmd_cache_version(queue->mode), key));
+        if (cmd_cache_fetch(cache, key, file->output) == ELF_OK) {
+            file->cached = 1;
+            file->load_ns = cmd_now() - start;
+            return elf_stack_error(ELF_OK);
+        }
+    }
+
+    start = cmd_now();
+    elf_check(elf_load_elf(file->input));
+    file->load_ns = cmd_now() - start;
+
+    // files are the unit of parallelism, each one is patched on one thread.
+    start = cmd_now();
+    elf_manifest manifest;
+    elf_patch_options options = { .threads = 1, .mode = queue->mode };
+    int error = elf_patch_elf_woptions(queue->entry, &options, &file->stats, &manifest);
+    file->patch_ns = cmd_now() - start;
+
+    if (error == ELF_OK) {
+        start = cmd_now();
+        error = cmd_save_outputs(file->output, &manifest);
+        file->save_ns = cmd_now() - start;
+    }
+
+    elf_check(elf_unload_elf());
+    if (error == ELF_OK && cache->directory != NULL) {
+        error = cmd_cache_store(cache, key, file->output);
+    }
+    return elf_stack_error(error);
+}
+
+static void* cmd_batch_worker(void* arg)
+{
+    cmd_batch_queue* queue = arg;
+    elf_context* context;
+    if (elf_create_context(&context) != ELF_OK) {
+        return NULL;
+    }
+
+    elf_bind_context(context);
+    size_t index;
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->length) {
+        cmd_batch_file* file = &queue->files[index];
+        file->error = cmd_batch_patch(file, queue);
+    }
+
+    elf_bind_context(NULL);
+    elf_destroy_context(context);
+    return NULL;
+}
+
+static int cmd_batch_read_manifest(const char* path, char** text_ref, char*** tokens_ref, int* tok_num)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    long size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+    if (size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    char* text = malloc(size + 1);
+    char** tokens = malloc((size / 2 + 1) * sizeof(*tokens));
+    if (text == NULL || tokens == NULL || fread(text, 1, size, file) != (size_t)size) {
+        free(text);
+        free(tokens);
+        fclose(file);
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    fclose(file);
+    text[size] = '\0';
+    int error = elf_tokenize(text, size / 2 + 1, tokens, tok_num);
+    if (error != ELF_OK) {
+        free(text);
+        free(tokens);
+        return elf_stack_error(error);
+    }
+    *text_ref = text;
+    *tokens_ref = tokens;
+    return elf_stack_error(ELF_OK);
+}
+
+static int cmd_batch_run(const char* entry, long jobs, char** paths, int path_num)
+{
+    if (path_num % 2 != 0) {
+        puts("batch: every input needs an output.");
+        return elf_stack_error(ELF_ERR_ARGC);
+    }
+
+    cmd_batch_queue queue = { .length = path_num / 2, .entry = entry };
+    elf_check(cmd_cache_config(&queue.cache));
+    elf_check(cmd_patch_mode(&queue.mode));
+    queue.files = calloc(queue.length + 1, sizeof(*queue.files));
+    if (queue.files == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    for (size_t i = 0; i < queue.length; i++) {
+        queue.files[i].input = paths[2 * i];
+        queue.files[i].output = paths[2 * i + 1];
+        queue.files[i].error = ELF_ERR_NOT_IMPL;
+    }
+
+    size_t workers = ((size_t)jobs < queue.length) ? (size_t)jobs : queue.length;
+    pthread_t handles[CMD_BATCH_MAX_JOBS];
+    size_t started = 0;
+    uint64_t start = cmd_now();
+    for (; started < workers; started++) {
+        if (pthread_create(&handles[started], NULL, cmd_batch_worker, &queue) != 0) {
+            break;
+        }
+    }
+
+    if (started == 0) {
+        cmd_batch_worker(&queue);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    uint64_t total_ns = cmd_now() - start;
+
+    // reported in manifest order, whatever order the workers finished in.
+    size_t failed = 0;
+    size_t cached = 0;
+    elf_patch_stats total = { 0 };
+    for (size_t i = 0; i < queue.length; i++) {
+        cmd_batch_file* file = &queue.files[i];
+        if (file->error != ELF_OK) {
+            printf("%s -> %s: error %i\n", file->input, file->output, file->error);
+            failed++;
+            continue;
+        }
+        if (file->cached) {
+            printf("%s -> %s: cached, %.3f ms\n", file->input, file->output, file->load_ns / 1e6);
+            cached++;
+            continue;
+        }
+
+        printf("%s -> %s: patched %zu, skipped %zu, load %.3f ms, patch %.3f ms, save %.3f ms\n",
+            file->input, file->output, file->stats.patched, file->stats.skipped,
+            file->load_ns / 1e6, file->patch_ns / 1e6, file->save_ns / 1e6);
+        total.patched += file->stats.patched;
+        total.skipped += file->stats.skipped;
+    }
+
+    printf("\nFiles: %zu\nFailed: %zu\nCached: %zu\nPatched: %zu\nSkipped: %zu\nTime: %.3f ms\n",
+        queue.length, failed, cached, total.patched, total.skipped, total_ns / 1e6);
+
+    free(queue.files);
+    return elf_stack_error((failed == 0) ? ELF_OK : ELF_ERR_WRITE);
+}
+
+int cmd_batch(int argc, char** argv)
+{
+    if (argc < 6) {
+        puts("batch: <entrypoint> <jobs> <input> <output> [<input> <output> ...]");
+        puts("batch: <entrypoint> <jobs> -f <manifest>");
+        return elf_stack_error(ELF_OK);
+    }
+
+    const char* entry = argv[2];
+    char* end;
+    long jobs = strtol(argv[3], &end, 10);
+    if (*end != '\0' || jobs < 1 || jobs > CMD_BATCH_MAX_JOBS) {
+        printf("batch: jobs must be between 1 and %i.\n", CMD_BATCH_MAX_JOBS);
+        return elf_stack_error(ELF_ERR_NOT_NUMBER);
+    }
+
+    // manifest: whitespace separated pairs of input and output paths.
+    char* manifest = NULL;
+    char** paths = argv + 4;
+    int path_num = argc - 4;
+    if (strcmp(argv[4], "-f") == 0) {
+        elf_check(cmd_batch_read_manifest(argv[5], &manifest, &paths, &path_num));
+    }
+
+    int error = cmd_batch_run(entry, jobs, paths, path_num);
+    if (manifest != NULL) {
+        free(manifest);
+        free(paths);
+    }
+    return elf_stack_error(error);
+}
+
+
+typedef struct {
+    const char* path;
+    elf_context* context;
+    elf_manifest manifest;
+    int error;
+} cmd_diff_side;
+
+static int cmd_diff_is_elf(const char* path, int* is_elf_ref)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    unsigned char magic[SELFMAG] = { 0 };
+    *is_elf_ref = fread(magic, 1, SELFMAG, file) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+    fclose(file);
+    return elf_stack_error(ELF_OK);
+}
+
+static int cmd_diff_load(cmd_diff_side* side)
+{
+    int is_elf = 0;
+    elf_check(cmd_diff_is_elf(side->path, &is_elf));
+
+    // an elf is hashed in its own context, a .gtm manifest is read as is.
+    if (is_elf) {
+        elf_check(elf_create_context(&side->context));
+        elf_bind_context(side->context);
+        elf_check(elf_load_elf(side->path));
+        elf_check(elf_build_manifest(&side->manifest));
+    } else {
+        elf_check(elf_load_manifest(side->path, &side->manifest));
+    }
+
+    elf_check(elf_sort_manifest(&side->manifest));
+    return elf_stack_error(ELF_OK);
+}
+
+static void* cmd_diff_worker(void* arg)
+{
+    cmd_diff_side* side = arg;
+    side->error = cmd_diff_load(side);
+    elf_bind_context(NULL);
+    return NULL;
+}
+
+int cmd_diff(int argc, char** argv)
+{
+    if (argc < 4) {
+        puts("diff: <old elf or .gtm> <new elf or .gtm>");
+        return elf_stack_error(ELF_OK);
+    }
+
+    cmd_diff_side sides[2] = { { .path = argv[2] }, { .path = argv[3] } };
+    pthread_t handle;
+    int started = pthread_create(&handle, NULL, cmd_diff_worker, &sides[1]) == 0;
+    cmd_diff_worker(&sides[0]);
+    if (started) {
+        pthread_join(handle, NULL);
+    } else {
+        cmd_diff_worker(&sides[1]);
+    }
+
+    int error = (sides[0].error != ELF_OK) ? sides[0].error : sides[1].error;
+    size_t changed = 0;
+    size_t added = 0;
+    size_t removed = 0;
+    size_t unchanged = 0;
+
+    // both manifests are sorted by name, same-named functions pair up in order.
+    const elf_manifest* old = &sides[0].manifest;
+    const elf_manifest* new = &sides[1].manifest;
+    size_t i = 0;
+    size_t j = 0;
+    while (error == ELF_OK && (i < old->length || j < new->length)) {
+        int order = (i == old->length) ? 1 : (j == new->length) ? -1 : strcmp(old->entry[i].name, new->entry[j].name);
+        if (order < 0) {
+            printf("removed %s\n", old->entry[i++].name);
+            removed++;
+        } else if (order > 0) {
+            printf("added %s\n", new->entry[j++].name);
+            added++;
+        } else {
+            const elf_manifest_entry* a = &old->entry[i++];
+            const elf_manifest_entry* b = &new->entry[j++];
+            if (a->size != b->size || a->hash[0] != b->hash[0] || a->hash[1] != b->hash[1]) {
+                printf("changed %s\n", b->name);
+                changed++;
+            } else {
+                unchanged++;
+            }
+        }
+    }
+
+    if (error == ELF_OK) {
+        printf("\nChanged: %zu\nAdded: %zu\nRemoved: %zu\nUnchanged: %zu\n", changed, added, removed, unchanged);
+    }
+
+    for (size_t s = 0; s < 2; s++) {
+        elf_free_manifest(&sides[s].manifest);
+        if (sides[s].context != NULL) {
+            elf_destroy_context(sides[s].context);
+        }
+    }
+    return elf_stack_error(error);
+}
+
 int cmd_elf(int argc, char** argv)
 {
     if (argc >= 3) {
@@ -167,8 +607,14 @@ int main(int argc, char** argv)
     } else if (strcmp(argv[1], "elf") == 0) {
         check(cmd_elf(argc, argv));
         return 0;
+    } else if (strcmp(argv[1], "batch") == 0) {
+        check(cmd_batch(argc, argv));
+        return 0;
+    } else if (strcmp(argv[1], "diff") == 0) {
+        check(cmd_diff(argc, argv));
+        return 0;
     } else {
-        puts("...: elf");
+        puts("...: elf, batch, diff");
         return 1;
     }
 }
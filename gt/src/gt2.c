@@ -3,10 +3,25 @@
 */
 
 #include "gt2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/membarrier.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 static const char* const gt_op[] = {
     "==",
@@ -27,6 +42,7 @@ static struct {
     struct {
         const char* name;
         uint64_t result;
+        int site_error;
     } Case;
 
     struct {
@@ -42,70 +58,1561 @@ static struct {
 void* gt_hijack = NULL;
 void* gt_mock = NULL;
 void* gt_data = NULL;
+gt_patch_descriptor gt_patch_table = { .magic = GT_PATCH_TABLE_MAGIC };
+
+// slots mocked by the running test case, cleared when it ends.
+#define GT_ACTIVE_MOCK_MAX 256
+
+static struct {
+    gt_mock_slot* active[GT_ACTIVE_MOCK_MAX];
+    uint64_t active_nb;
+    gt_mock_slot* last;
+} mocks = { 0 };
+
+static gt_mock_slot* gt_find_slot(const void* function_ptr)
+{
+    // an executable that was not patched has an empty table.
+    const gt_patch_descriptor* table = &gt_patch_table;
+    if (table->count == 0) {
+        return NULL;
+    }
+
+    const int64_t* sites = (const int64_t*)((const char*)table + table->sites);
+    gt_mock_slot* slots = (gt_mock_slot*)((char*)table + table->slots);
+    int64_t key = (const char*)function_ptr - (const char*)table;
+
+    uint64_t low = 0;
+    uint64_t high = table->count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (sites[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return (low < table->count && sites[low] == key) ? &slots[low] : NULL;
+}
+
+static struct {
+    pthread_mutex_t lock;
+    int sync_core;
+    uintptr_t page;
+    int prot;
+} sites = { .lock = PTHREAD_MUTEX_INITIALIZER, .sync_core = -1 };
+
+// the protection of a mapped page, from /proc/self/maps; the last page looked
+// up is kept, the sites of a test are often on the same page.
+static int gt_page_prot(uintptr_t page)
+{
+    if (sites.page == page) {
+        return sites.prot;
+    }
+
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        return -1;
+    }
+
+    unsigned long low;
+    unsigned long high;
+    char perms[5];
+    int prot = -1;
+    while (prot < 0 && fscanf(maps, "%lx-%lx %4s%*[^\n]", &low, &high, perms) == 3) {
+        if (page >= low && page < high) {
+            prot = ((perms[0] == 'r') ? PROT_READ : 0) | ((perms[1] == 'w') ? PROT_WRITE : 0) | ((perms[2] == 'x') ? PROT_EXEC : 0);
+        }
+    }
+    fclose(maps);
+
+    if (prot >= 0) {
+        sites.page = page;
+        sites.prot = prot;
+    }
+    return prot;
+}
+
+static void gt_sync_cores(void)
+{
+    // threads running the old bytes must refetch them before the site is reused.
+    if (sites.sync_core < 0) {
+        sites.sync_core = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0) == 0;
+    }
+    if (sites.sync_core) {
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0);
+    }
+}
+
+static void gt_write_site(gt_mock_slot* slot, int armed)
+{
+    const gt_patch_descriptor* table = &gt_patch_table;
+    uint64_t index = slot - (gt_mock_slot*)((char*)table + table->slots);
+    const int64_t* offsets = (const int64_t*)((const char*)table + table->sites);
+    const gt_patch_toggle* toggle = (const gt_patch_toggle*)((const char*)table + table->toggles) + index;
+    if (toggle->armed == toggle->disarmed) {
+        return;
+    }
+
+    uint8_t* site = (uint8_t*)table + offsets[index] + toggle->entry;
+    uint16_t bytes = armed ? toggle->armed : toggle->disarmed;
+    uint16_t current;
+    memcpy(&current, site, sizeof(current));
+    if (current == bytes) {
+        return;
+    }
+
+    // the patcher keeps both bytes in one aligned word, which is replaced at once:
+    // a thread fetching the site sees either the jump or the check.
+    uintptr_t word_address = (uintptr_t)site & ~(uintptr_t)7;
+    unsigned shift = ((uintptr_t)site - word_address) * 8;
+    uint64_t mask = (uint64_t)0xffff << shift;
+    uint64_t* word = (uint64_t*)word_address;
+
+    // the page keeps its execute access while it is written: it may hold the
+    // code running now, this function included. a system that refuses writable
+    // and executable pages leaves the site as it is.
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    void* page = (void*)(word_address & ~(page_size - 1));
+    pthread_mutex_lock(&sites.lock);
+    int prot = gt_page_prot((uintptr_t)page);
+    int error = (prot < 0) ? ENOENT : 0;
+    if (error == 0 && mprotect(page, page_size, prot | PROT_WRITE) != 0) {
+        error = errno;
+    }
+
+    if (error == 0) {
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        uint64_t new;
+        do {
+            new = (old & ~mask) | ((uint64_t)bytes << shift);
+        } while (!__atomic_compare_exchange_n(word, &old, new, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        error = (mprotect(page, page_size, prot) != 0) ? errno : 0;
+        gt_sync_cores();
+    }
+    pthread_mutex_unlock(&sites.lock);
+
+    // a site left armed still checks its slot and reaches the real function
+    // when it is empty; one left disarmed misses its mock, the running case
+    // fails at its next assertion or when it ends.
+    if (error != 0) {
+        fprintf(stderr, "gt: could not write the patch site at %p: %s\n", (void*)site, strerror(error));
+        if (armed) {
+            global.Case.site_error = error;
+            global.Case.result = GT_LOOP_LEAVE;
+        }
+    }
+}
+
+static void gt_set_slot(gt_mock_slot* slot, void* mock_ptr, void* data)
+{
+    // patched code reads the mock pointer, it is published after its data,
+    // and the site is armed once the slot is ready.
+    slot->data = data;
+    __atomic_store_n(&slot->mock, mock_ptr, __ATOMIC_RELEASE);
+    gt_write_site(slot, mock_ptr != NULL);
+}
+
+static void gt_clear_active_mocks(void)
+{
+    for (uint64_t i = 0; i < mocks.active_nb && i < GT_ACTIVE_MOCK_MAX; i++) {
+        gt_set_slot(mocks.active[i], NULL, NULL);
+    }
+
+    // more mocks than could be tracked, every slot is cleared.
+    if (mocks.active_nb > GT_ACTIVE_MOCK_MAX) {
+        gt_mock_slot* slots = (gt_mock_slot*)((char*)&gt_patch_table + gt_patch_table.slots);
+        for (uint64_t i = 0; i < gt_patch_table.count; i++) {
+            gt_set_slot(&slots[i], NULL, NULL);
+        }
+    }
+
+    mocks.active_nb = 0;
+    mocks.last = NULL;
+}
+
+// with GT_JOBS, every test case runs in a forked worker; its output comes back
+// over a pipe and cases are printed in the order they appear in gt_test_main.
+enum {
+    GT_EVENT_FUNCTION_ENTER,
+    GT_EVENT_FUNCTION_LEAVE,
+    GT_EVENT_CASE,
+};
+
+typedef struct {
+    int kind;
+    int done;
+    int timed_out;
+    int status;
+    int fd;
+    pid_t pid;
+    const gt_test_descriptor* descriptor;
+    struct timespec start;
+    struct timespec deadline;
+    double seconds;
+    char* output;
+    size_t length;
+    size_t capacity;
+} gt_event;
+
+static struct {
+    uint64_t jobs;
+    uint64_t timeout;
+    int worker;
+    gt_event* events;
+    uint64_t event_nb;
+    uint64_t event_cap;
+    uint64_t printed;
+    uint64_t running;
+} runner = { 0 };
+
+// every case ends with one of these; a worker appends it to its output. the
+// strings it points to are literals of the executable, valid in the parent.
+#define GT_RESULT_MAGIC 0x746c757365727467ull
+
+// the exit status of a worker that could not write its result.
+#define GT_RESULT_LOST 125
+
+enum {
+    GT_RESULT_PASS,
+    GT_RESULT_FAIL,
+    GT_RESULT_SIGNAL,
+    GT_RESULT_TIMEOUT,
+    GT_RESULT_EXIT,
+    GT_RESULT_SITE,
+};
+
+static const char* const gt_result_name[] = {
+    "pass",
+    "fail",
+    "signal",
+    "timeout",
+    "exit",
+    "site",
+};
+
+typedef struct {
+    uint64_t magic;
+    uint32_t kind;
+    uint32_t code;
+    gt_mode mode;
+    unsigned line;
+    const char* file;
+    const char* a;
+    const char* b;
+    char a_value[128];
+    char b_value[128];
+} gt_case_result;
+
+// nanoseconds per iteration over the samples of a benchmark; change is the
+// relative change of the median from the baseline, when there is one.
+typedef struct {
+    uint64_t sample_nb;
+    uint64_t iterations;
+    double min;
+    double median;
+    double mean;
+    double p99;
+    int compared;
+    int regressed;
+    double change;
+    double p_value;
+    double threshold;
+} gt_bench_result;
+
+typedef struct {
+    const char* name;
+    void (*begin)(void);
+    void (*end)(void);
+    void (*function_begin)(const char* name);
+    void (*function_end)(const char* name);
+    void (*case_begin)(const char* name);
+    void (*case_end)(const char* name, const gt_case_result* result, const char* output, size_t length, double seconds);
+    void (*bench_end)(const char* name, const gt_bench_result* bench, double seconds);
+} gt_reporter;
+
+// output is formatted into one buffer and written in large chunks; it is
+// written at once on a terminal, where colors are used.
+static struct {
+    int ready;
+    int interactive;
+    int color;
+    const gt_reporter* backend;
+    uint64_t number;
+    uint64_t success_nb;
+    uint64_t failure_nb;
+    size_t length;
+    char buffer[1 << 16];
+} report = { 0 };
+
+static void gt_report_flush(void)
+{
+    size_t written = 0;
+    while (written < report.length) {
+        ssize_t size = write(STDOUT_FILENO, report.buffer + written, report.length - written);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            break;
+        }
+        written += size;
+    }
+    report.length = 0;
+}
+
+static void gt_report_sync(void)
+{
+    // what a test printed with stdio follows what is already buffered here.
+    if (__fpending(stdout) > 0) {
+        gt_report_flush();
+        fflush(stdout);
+    }
+}
+
+static void gt_report_write(const char* data, size_t size)
+{
+    gt_report_sync();
+    while (size > 0) {
+        if (report.length == sizeof(report.buffer)) {
+            gt_report_flush();
+        }
+        size_t chunk = sizeof(report.buffer) - report.length;
+        chunk = (size < chunk) ? size : chunk;
+        memcpy(report.buffer + report.length, data, chunk);
+        report.length += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+static void gt_report_vprintf(const char* format, va_list argv)
+{
+    gt_report_sync();
+    va_list copy;
+    va_copy(copy, argv);
+    size_t space = sizeof(report.buffer) - report.length;
+    int size = vsnprintf(report.buffer + report.length, space, format, argv);
+    if (size >= 0 && (size_t)size >= space) {
+        // longer than the whole buffer, the line is cut.
+        gt_report_flush();
+        size = vsnprintf(report.buffer, sizeof(report.buffer), format, copy);
+        size = ((size_t)size < sizeof(report.buffer)) ? size : (int)sizeof(report.buffer) - 1;
+    }
+    report.length += (size > 0) ? size : 0;
+    va_end(copy);
+}
+
+static void gt_report_printf(const char* format, ...)
+{
+    va_list argv;
+    va_start(argv, format);
+    gt_report_vprintf(format, argv);
+    va_end(argv);
+}
+
+static void gt_report_json(const char* data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    gt_report_write("\"", 1);
+    size_t plain = 0;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        gt_report_write(data + plain, i - plain);
+        plain = i + 1;
+        char escape[6] = { '\\', c, 0, 0, 0, 0 };
+        size_t escape_size = 2;
+        if (c == '\n' || c == '\t' || c == '\r') {
+            escape[1] = (c == '\n') ? 'n' : (c == '\t') ? 't' : 'r';
+        } else if (c < 0x20) {
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = hex[c >> 4];
+            escape[5] = hex[c & 15];
+            escape_size = 6;
+        }
+        gt_report_write(escape, escape_size);
+    }
+    gt_report_write(data + plain, size - plain);
+    gt_report_write("\"", 1);
+}
+
+static void gt_report_xml(const char* data, size_t size)
+{
+    size_t plain = 0;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        const char* entity = NULL;
+        switch (c) {
+        case '&':
+            entity = "&amp;";
+            break;
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        default:
+            // control characters are not allowed in xml 1.0.
+            entity = (c < 0x20 && c != '\n' && c != '\t' && c != '\r') ? "" : NULL;
+        }
+
+        if (entity != NULL) {
+            gt_report_write(data + plain, i - plain);
+            gt_report_write(entity, strlen(entity));
+            plain = i + 1;
+        }
+    }
+    gt_report_write(data + plain, size - plain);
+}
 
 static void gt_set_output_color(int reset, int foreground, int background)
 {
-    if ((foreground >= 30 && foreground <= 37) || (foreground > 90 && foreground < 97)) {
-        printf("\x1b[%im", foreground);
+    if (!report.color) {
+        return;
+    }
+
+    if ((foreground >= 30 && foreground <= 37) || (foreground > 90 && foreground < 97)) {
+        gt_report_printf("\x1b[%im", foreground);
+    }
+
+    if ((background >= 40 && background <= 47) || (background > 100 && background < 107)) {
+        gt_report_printf("\x1b[%im", background);
+    }
+
+    if (reset) {
+        gt_report_write("\x1b[0m", 4);
+    }
+}
+
+static void gt_print(int foreground, int background, const char* format, ...)
+{
+    va_list argv;
+    va_start(argv, format);
+    gt_set_output_color(0, foreground, background);
+    gt_report_vprintf(format, argv);
+    gt_set_output_color(1, 0, 0);
+    va_end(argv);
+}
+
+static void gt_println(int foreground, int background, const char* format, ...)
+{
+    va_list argv;
+    va_start(argv, format);
+    gt_set_output_color(0, foreground, background);
+    gt_report_vprintf(format, argv);
+    gt_set_output_color(1, 0, 0);
+    gt_report_write("\n", 1);
+    va_end(argv);
+}
+
+static void gt_print_indent(void)
+{
+    gt_report_write("    ", 4);
+}
+
+static void gt_format_generic(char* buffer, size_t size, gt_generic generic, gt_type type)
+{
+    switch (type) {
+    case GT_TYPE_U_64:
+        snprintf(buffer, size, "%lu", generic.u_64);
+        break;
+    case GT_TYPE_S_64:
+        snprintf(buffer, size, "%li", generic.s_64);
+        break;
+    case GT_TYPE_F_64:
+        snprintf(buffer, size, "%lf", generic.f_64);
+        break;
+    case GT_TYPE_CSTR:
+        snprintf(buffer, size, "%s", generic.cstr);
+        break;
+    case GT_TYPE_ADDR:
+        snprintf(buffer, size, "%p", generic.addr);
+        break;
+    default:
+        snprintf(buffer, size, "invalid type");
+    }
+}
+
+static void gt_format_result(char* buffer, size_t size, const gt_case_result* result)
+{
+    switch (result->kind) {
+    case GT_RESULT_FAIL:
+        snprintf(buffer, size, "%s %s %s", result->a, gt_op[result->mode], result->b);
+        break;
+    case GT_RESULT_SIGNAL:
+        snprintf(buffer, size, "signal: %s", strsignal(result->code));
+        break;
+    case GT_RESULT_TIMEOUT:
+        snprintf(buffer, size, "timeout: %u s", result->code);
+        break;
+    case GT_RESULT_EXIT:
+        snprintf(buffer, size, "exit: %u", result->code);
+        break;
+    case GT_RESULT_SITE:
+        snprintf(buffer, size, "patch site: %s", strerror(result->code));
+        break;
+    default:
+        buffer[0] = '\0';
+    }
+}
+
+static void gt_format_duration(char* buffer, size_t size, double nanoseconds)
+{
+    if (nanoseconds < 1e3) {
+        snprintf(buffer, size, "%.2f ns", nanoseconds);
+    } else if (nanoseconds < 1e6) {
+        snprintf(buffer, size, "%.2f us", nanoseconds / 1e3);
+    } else if (nanoseconds < 1e9) {
+        snprintf(buffer, size, "%.2f ms", nanoseconds / 1e6);
+    } else {
+        snprintf(buffer, size, "%.2f s", nanoseconds / 1e9);
+    }
+}
+
+static void gt_text_function_begin(const char* name)
+{
+    gt_println(33, 0, "%s", name);
+}
+
+static void gt_text_function_end(const char* name)
+{
+    gt_print_indent();
+    if (global.Function.failure_nb == 0 && global.Function.success_nb > 0) {
+        gt_println(36, 0, "%lu test case passed", global.Function.success_nb);
+    } else if (global.Function.failure_nb > 0 && global.Function.success_nb > 0) {
+        gt_println(36, 0, "%lu test case passed, %lu test case failed", global.Function.success_nb, global.Function.failure_nb);
+    } else if (global.Function.failure_nb > 0 && global.Function.success_nb == 0) {
+        gt_println(36, 0, "%lu test case failed", global.Function.failure_nb);
+    } else {
+        gt_print(33, 0, "%s ", name);
+        gt_println(0, 0, " skipped");
+    }
+}
+
+static void gt_text_case_begin(const char* name)
+{
+    static const char dots[] = "..............................";
+    size_t length = strlen(name);
+    gt_print_indent();
+    gt_print(33, 0, "%s ", name);
+    gt_report_write(dots, (length < sizeof(dots) - 1) ? sizeof(dots) - 1 - length : 0);
+}
+
+static void gt_text_case_end(const char* name, const gt_case_result* result, const char* output, size_t length, double seconds)
+{
+    gt_report_write(output, length);
+    if (result->kind == GT_RESULT_PASS) {
+        gt_println(30, 102, "PASS");
+        return;
+    }
+
+    char message[512];
+    gt_format_result(message, sizeof(message), result);
+    gt_println(30, 101, "FAIL");
+    if (result->kind != GT_RESULT_FAIL) {
+        gt_print_indent();
+        gt_print_indent();
+        gt_println(0, 0, "%s", message);
+        return;
+    }
+
+    gt_print_indent();
+    gt_print_indent();
+    gt_println(0, 0, "file: %s", result->file);
+    gt_print_indent();
+    gt_print_indent();
+    gt_println(0, 0, "line: %u", result->line);
+    gt_print_indent();
+    gt_print_indent();
+    gt_println(0, 0, "expr: %s", message);
+    gt_print_indent();
+    gt_print_indent();
+    gt_print(0, 0, "-> %s = ", result->a);
+    gt_println(91, 0, "%s", result->a_value);
+    gt_print_indent();
+    gt_print_indent();
+    gt_print(0, 0, "-> %s = ", result->b);
+    gt_println(91, 0, "%s", result->b_value);
+}
+
+static void gt_text_bench_end(const char* name, const gt_bench_result* bench, double seconds)
+{
+    char min[32], median[32], mean[32], p99[32];
+    gt_format_duration(min, sizeof(min), bench->min);
+    gt_format_duration(median, sizeof(median), bench->median);
+    gt_format_duration(mean, sizeof(mean), bench->mean);
+    gt_format_duration(p99, sizeof(p99), bench->p99);
+    if (bench->regressed) {
+        gt_println(30, 101, "FAIL");
+    } else {
+        gt_println(30, 106, "BENCH");
+    }
+    gt_print_indent();
+    gt_print_indent();
+    gt_println(0, 0, "min: %s, median: %s, mean: %s, p99: %s", min, median, mean, p99);
+    gt_print_indent();
+    gt_print_indent();
+    gt_println(0, 0, "samples: %lu x %lu iterations", bench->sample_nb, bench->iterations);
+    if (bench->compared) {
+        gt_print_indent();
+        gt_print_indent();
+        gt_print(0, 0, "baseline: ");
+        gt_print(bench->regressed ? 91 : 0, 0, "%+.2f%%", bench->change * 100);
+        gt_println(0, 0, " (p = %.4f, threshold %.2f%%)%s", bench->p_value, bench->threshold * 100, bench->regressed ? ", regression" : "");
+    }
+}
+
+static void gt_tap_begin(void)
+{
+    gt_report_write("TAP version 13\n", 15);
+}
+
+static void gt_tap_end(void)
+{
+    gt_report_printf("1..%lu\n", report.number);
+}
+
+static void gt_tap_function_begin(const char* name)
+{
+    gt_report_printf("# %s\n", name);
+}
+
+static void gt_tap_case_end(const char* name, const gt_case_result* result, const char* output, size_t length, double seconds)
+{
+    // the output of a worker becomes diagnostic lines.
+    for (size_t start = 0; start < length;) {
+        const char* end = memchr(output + start, '\n', length - start);
+        size_t line = (end != NULL) ? (size_t)(end - output) - start : length - start;
+        gt_report_write("# ", 2);
+        gt_report_write(output + start, line);
+        gt_report_write("\n", 1);
+        start += line + 1;
+    }
+
+    int passed = (result->kind == GT_RESULT_PASS);
+    gt_report_printf("%s %lu - %s/%s\n", passed ? "ok" : "not ok", report.number, global.Function.name, name);
+    if (passed) {
+        return;
+    }
+
+    char message[512];
+    gt_format_result(message, sizeof(message), result);
+    gt_report_write("  ---\n  message: ", 17);
+    gt_report_json(message, strlen(message));
+    gt_report_printf("\n  result: %s\n", gt_result_name[result->kind]);
+    if (result->kind == GT_RESULT_FAIL) {
+        gt_report_write("  file: ", 8);
+        gt_report_json(result->file, strlen(result->file));
+        gt_report_printf("\n  line: %u\n  left: ", result->line);
+        gt_report_json(result->a_value, strlen(result->a_value));
+        gt_report_write("\n  right: ", 10);
+        gt_report_json(result->b_value, strlen(result->b_value));
+        gt_report_write("\n", 1);
+    }
+    gt_report_write("  ...\n", 6);
+}
+
+static void gt_tap_bench_end(const char* name, const gt_bench_result* bench, double seconds)
+{
+    gt_report_printf("%s %lu - %s/%s\n  ---\n", bench->regressed ? "not ok" : "ok", report.number, global.Function.name, name);
+    gt_report_printf("  min_ns: %.3f\n  median_ns: %.3f\n  mean_ns: %.3f\n  p99_ns: %.3f\n", bench->min, bench->median, bench->mean, bench->p99);
+    gt_report_printf("  samples: %lu\n  iterations: %lu\n", bench->sample_nb, bench->iterations);
+    if (bench->compared) {
+        gt_report_printf("  change: %.6f\n  p_value: %.6f\n  threshold: %.6f\n", bench->change, bench->p_value, bench->threshold);
+    }
+    if (bench->regressed) {
+        gt_report_printf("  message: \"regression: %+.2f%%\"\n", bench->change * 100);
+    }
+    gt_report_write("  ...\n", 6);
+}
+
+static void gt_junit_begin(void)
+{
+    static const char header[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n";
+    gt_report_write(header, sizeof(header) - 1);
+}
+
+static void gt_junit_end(void)
+{
+    gt_report_write("</testsuites>\n", 14);
+}
+
+static void gt_junit_function_begin(const char* name)
+{
+    gt_report_write("  <testsuite name=\"", 19);
+    gt_report_xml(name, strlen(name));
+    gt_report_write("\">\n", 3);
+}
+
+static void gt_junit_function_end(const char* name)
+{
+    gt_report_write("  </testsuite>\n", 15);
+}
+
+static void gt_junit_case_end(const char* name, const gt_case_result* result, const char* output, size_t length, double seconds)
+{
+    gt_report_write("    <testcase classname=\"", 25);
+    gt_report_xml(global.Function.name, strlen(global.Function.name));
+    gt_report_write("\" name=\"", 8);
+    gt_report_xml(name, strlen(name));
+    gt_report_printf("\" time=\"%.6f\"", seconds);
+    if (result->kind == GT_RESULT_PASS && length == 0) {
+        gt_report_write("/>\n", 3);
+        return;
+    }
+
+    gt_report_write(">\n", 2);
+    if (result->kind != GT_RESULT_PASS) {
+        // an assertion is a failure, a worker that died is an error.
+        char message[512];
+        const char* element = (result->kind == GT_RESULT_FAIL) ? "failure" : "error";
+        gt_format_result(message, sizeof(message), result);
+        gt_report_printf("      <%s type=\"%s\" message=\"", element, gt_result_name[result->kind]);
+        gt_report_xml(message, strlen(message));
+        gt_report_write("\">", 2);
+        if (result->kind == GT_RESULT_FAIL) {
+            gt_report_xml(result->file, strlen(result->file));
+            gt_report_printf(":%u\n", result->line);
+            gt_report_xml(result->a, strlen(result->a));
+            gt_report_write(" = ", 3);
+            gt_report_xml(result->a_value, strlen(result->a_value));
+            gt_report_write("\n", 1);
+            gt_report_xml(result->b, strlen(result->b));
+            gt_report_write(" = ", 3);
+            gt_report_xml(result->b_value, strlen(result->b_value));
+        }
+        gt_report_printf("</%s>\n", element);
+    }
+
+    if (length > 0) {
+        gt_report_write("      <system-out>", 18);
+        gt_report_xml(output, length);
+        gt_report_write("</system-out>\n", 14);
+    }
+    gt_report_write("    </testcase>\n", 16);
+}
+
+static void gt_junit_bench_end(const char* name, const gt_bench_result* bench, double seconds)
+{
+    gt_report_write("    <testcase classname=\"", 25);
+    gt_report_xml(global.Function.name, strlen(global.Function.name));
+    gt_report_write("\" name=\"", 8);
+    gt_report_xml(name, strlen(name));
+    gt_report_printf("\" time=\"%.6f\">\n", seconds);
+    if (bench->regressed) {
+        gt_report_printf("      <failure type=\"regression\" message=\"regression: %+.2f%%\">p = %.6f, threshold %.2f%%</failure>\n",
+            bench->change * 100, bench->p_value, bench->threshold * 100);
+    }
+    gt_report_printf("      <system-out>min_ns=%.3f median_ns=%.3f mean_ns=%.3f p99_ns=%.3f samples=%lu iterations=%lu",
+        bench->min, bench->median, bench->mean, bench->p99, bench->sample_nb, bench->iterations);
+    if (bench->compared) {
+        gt_report_printf(" change=%.6f p_value=%.6f threshold=%.6f", bench->change, bench->p_value, bench->threshold);
+    }
+    gt_report_write("</system-out>\n", 14);
+    gt_report_write("    </testcase>\n", 16);
+}
+
+static void gt_json_end(void)
+{
+    gt_report_printf("{\"event\":\"summary\",\"passed\":%lu,\"failed\":%lu}\n", report.success_nb, report.failure_nb);
+}
+
+static void gt_json_function_end(const char* name)
+{
+    gt_report_write("{\"event\":\"function\",\"function\":", 31);
+    gt_report_json(name, strlen(name));
+    gt_report_printf(",\"passed\":%lu,\"failed\":%lu}\n", global.Function.success_nb, global.Function.failure_nb);
+}
+
+static void gt_json_case_end(const char* name, const gt_case_result* result, const char* output, size_t length, double seconds)
+{
+    gt_report_write("{\"event\":\"case\",\"function\":", 27);
+    gt_report_json(global.Function.name, strlen(global.Function.name));
+    gt_report_write(",\"case\":", 8);
+    gt_report_json(name, strlen(name));
+    gt_report_printf(",\"result\":\"%s\",\"seconds\":%.6f", gt_result_name[result->kind], seconds);
+    if (result->kind != GT_RESULT_PASS) {
+        char message[512];
+        gt_format_result(message, sizeof(message), result);
+        gt_report_write(",\"message\":", 11);
+        gt_report_json(message, strlen(message));
+    }
+    if (result->kind == GT_RESULT_FAIL) {
+        gt_report_write(",\"file\":", 8);
+        gt_report_json(result->file, strlen(result->file));
+        gt_report_printf(",\"line\":%u,\"left\":", result->line);
+        gt_report_json(result->a_value, strlen(result->a_value));
+        gt_report_write(",\"right\":", 9);
+        gt_report_json(result->b_value, strlen(result->b_value));
+    }
+    if (length > 0) {
+        gt_report_write(",\"output\":", 10);
+        gt_report_json(output, length);
+    }
+    gt_report_write("}\n", 2);
+}
+
+static void gt_json_bench_end(const char* name, const gt_bench_result* bench, double seconds)
+{
+    gt_report_write("{\"event\":\"bench\",\"function\":", 28);
+    gt_report_json(global.Function.name, strlen(global.Function.name));
+    gt_report_write(",\"bench\":", 9);
+    gt_report_json(name, strlen(name));
+    gt_report_printf(",\"result\":\"%s\",\"seconds\":%.6f,\"min_ns\":%.3f,\"median_ns\":%.3f,\"mean_ns\":%.3f,\"p99_ns\":%.3f,\"samples\":%lu,\"iterations\":%lu",
+        bench->regressed ? "regression" : "pass", seconds, bench->min, bench->median, bench->mean, bench->p99, bench->sample_nb, bench->iterations);
+    if (bench->compared) {
+        gt_report_printf(",\"change\":%.6f,\"p_value\":%.6f,\"threshold\":%.6f", bench->change, bench->p_value, bench->threshold);
+    }
+    gt_report_write("}\n", 2);
+}
+
+static const gt_reporter gt_reporters[] = {
+    { "text", NULL, NULL, gt_text_function_begin, gt_text_function_end, gt_text_case_begin, gt_text_case_end, gt_text_bench_end },
+    { "tap", gt_tap_begin, gt_tap_end, gt_tap_function_begin, NULL, NULL, gt_tap_case_end, gt_tap_bench_end },
+    { "junit", gt_junit_begin, gt_junit_end, gt_junit_function_begin, gt_junit_function_end, NULL, gt_junit_case_end, gt_junit_bench_end },
+    { "json", NULL, gt_json_end, NULL, gt_json_function_end, NULL, gt_json_case_end, gt_json_bench_end },
+};
+
+// in a serial run, what a case prints is written to a temporary file for the
+// tap, junit and json reports, and read back as the output of a worker is. the
+// file, the copies of stdout and stderr and the buffer are kept for the run.
+static struct {
+    int active;
+    int fd;
+    int stdout_fd;
+    int stderr_fd;
+    char* buffer;
+    size_t capacity;
+} capture = { .fd = -1, .stdout_fd = -1, .stderr_fd = -1 };
+
+static void gt_capture_begin(void)
+{
+    if (report.backend == &gt_reporters[0]) {
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    gt_report_flush();
+    if (capture.fd < 0) {
+        FILE* file = tmpfile();
+        capture.fd = (file != NULL) ? dup(fileno(file)) : -1;
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    capture.stdout_fd = (capture.stdout_fd < 0) ? dup(STDOUT_FILENO) : capture.stdout_fd;
+    capture.stderr_fd = (capture.stderr_fd < 0) ? dup(STDERR_FILENO) : capture.stderr_fd;
+    if (capture.fd < 0 || capture.stdout_fd < 0 || capture.stderr_fd < 0) {
+        return;
+    }
+
+    dup2(capture.fd, STDOUT_FILENO);
+    dup2(capture.fd, STDERR_FILENO);
+    capture.active = 1;
+}
+
+// returns what the case printed, valid until the next case ends, or NULL.
+static const char* gt_capture_end(size_t* length)
+{
+    *length = 0;
+    if (!capture.active) {
+        return NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(capture.stdout_fd, STDOUT_FILENO);
+    dup2(capture.stderr_fd, STDERR_FILENO);
+    capture.active = 0;
+
+    // most cases print nothing, the file is only read and emptied when they do.
+    off_t size = lseek(capture.fd, 0, SEEK_CUR);
+    if (size <= 0) {
+        return NULL;
+    }
+    if ((size_t)size > capture.capacity) {
+        char* buffer = realloc(capture.buffer, size);
+        if (buffer != NULL) {
+            capture.buffer = buffer;
+            capture.capacity = size;
+        }
+    }
+
+    size_t wanted = ((size_t)size < capture.capacity) ? (size_t)size : capture.capacity;
+    ssize_t done = pread(capture.fd, capture.buffer, wanted, 0);
+    if (ftruncate(capture.fd, 0) != 0 || lseek(capture.fd, 0, SEEK_SET) != 0) {
+        close(capture.fd);
+        capture.fd = -1;
+    }
+    *length = (done > 0) ? (size_t)done : 0;
+    return capture.buffer;
+}
+
+static void gt_report_end(void)
+{
+    // a worker that exits early leaves the report to the parent.
+    if (runner.worker) {
+        return;
+    }
+
+    // a case that exits while it is captured still has its output printed.
+    size_t length;
+    const char* output = gt_capture_end(&length);
+    gt_report_write(output, length);
+
+    if (report.backend->end != NULL) {
+        report.backend->end();
+    }
+    gt_report_flush();
+}
+
+static void gt_report_setup(void)
+{
+    const char* name = getenv("GT_REPORT");
+    report.ready = 1;
+    report.backend = &gt_reporters[0];
+    for (uint64_t i = 0; name != NULL && i < sizeof(gt_reporters) / sizeof(gt_reporters[0]); i++) {
+        report.backend = (strcmp(name, gt_reporters[i].name) == 0) ? &gt_reporters[i] : report.backend;
+    }
+
+    if (name != NULL && strcmp(name, report.backend->name) != 0) {
+        fprintf(stderr, "Unknown GT_REPORT format: %s (text, tap, junit or json)\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    report.interactive = isatty(STDOUT_FILENO);
+    report.color = report.interactive && report.backend == &gt_reporters[0];
+    if (report.backend->begin != NULL) {
+        report.backend->begin();
+    }
+    atexit(gt_report_end);
+}
+
+static void gt_report_function_begin(const char* name)
+{
+    global.Function.name = name;
+    global.Function.failure_nb = 0;
+    global.Function.success_nb = 0;
+    if (report.backend->function_begin != NULL) {
+        report.backend->function_begin(name);
+    }
+    if (report.interactive) {
+        gt_report_flush();
+    }
+}
+
+static void gt_report_function_end(const char* name)
+{
+    if (report.backend->function_end != NULL) {
+        report.backend->function_end(name);
+    }
+    if (report.interactive) {
+        gt_report_flush();
+    }
+}
+
+static void gt_report_case_begin(const char* name)
+{
+    if (report.backend->case_begin != NULL) {
+        report.backend->case_begin(name);
+    }
+    if (report.interactive) {
+        gt_report_flush();
+    }
+}
+
+static void gt_report_case_end(const char* name, const gt_case_result* result, const char* output, size_t length, double seconds)
+{
+    int passed = (result->kind == GT_RESULT_PASS);
+    global.Function.success_nb += passed;
+    global.Function.failure_nb += !passed;
+    report.success_nb += passed;
+    report.failure_nb += !passed;
+    report.number++;
+    report.backend->case_end(name, result, output, length, seconds);
+    if (report.interactive) {
+        gt_report_flush();
+    }
+}
+
+static void gt_report_bench_end(const char* name, const gt_bench_result* bench, double seconds)
+{
+    global.Function.success_nb += !bench->regressed;
+    global.Function.failure_nb += bench->regressed;
+    report.success_nb += !bench->regressed;
+    report.failure_nb += bench->regressed;
+    report.number++;
+    report.backend->bench_end(name, bench, seconds);
+    if (report.interactive) {
+        gt_report_flush();
+    }
+}
+
+static void gt_case_result_of_assert(gt_case_result* result)
+{
+    *result = (gt_case_result) { .magic = GT_RESULT_MAGIC, .kind = GT_RESULT_PASS };
+    if (global.Case.site_error != 0) {
+        result->kind = GT_RESULT_SITE;
+        result->code = global.Case.site_error;
+        return;
+    }
+    if (global.Case.result == GT_LOOP_ENTER) {
+        return;
+    }
+
+    result->kind = GT_RESULT_FAIL;
+    result->mode = global.Assert.mode;
+    result->line = global.Assert.line;
+    result->file = global.Assert.file;
+    result->a = global.Assert.A.expression;
+    result->b = global.Assert.B.expression;
+    gt_format_generic(result->a_value, sizeof(result->a_value), global.Assert.A.generic, global.Assert.A.type);
+    gt_format_generic(result->b_value, sizeof(result->b_value), global.Assert.B.generic, global.Assert.B.type);
+}
+
+static void gt_fatal(const char* what)
+{
+    gt_report_flush();
+    fflush(stdout);
+    perror(what);
+    _exit(EXIT_FAILURE);
+}
+
+// descriptors are sorted by file and order of appearance; a case belongs to
+// the function before it in the same file.
+extern gt_test_descriptor __start_gt_tests[] __attribute__((weak));
+extern gt_test_descriptor __stop_gt_tests[] __attribute__((weak));
+
+static struct {
+    int ready;
+    uint64_t count;
+    int64_t* parent;
+    uint64_t* position;
+    char** name;
+    uint8_t* selected;
+    double* expected;
+    double* seconds;
+    const char* record;
+} registry = { 0 };
+
+static double gt_seconds_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void* gt_alloc(size_t count, size_t size)
+{
+    void* ptr = calloc(count > 0 ? count : 1, size);
+    if (ptr == NULL) {
+        gt_fatal("gt_alloc");
+    }
+    return ptr;
+}
+
+static int64_t gt_registry_index(const gt_test_descriptor* descriptor)
+{
+    if (registry.count == 0 || descriptor < __start_gt_tests || descriptor >= __stop_gt_tests) {
+        return -1;
+    }
+    return descriptor - __start_gt_tests;
+}
+
+static int gt_registry_compare_source(const void* a, const void* b)
+{
+    const gt_test_descriptor* x = *(const gt_test_descriptor* const*)a;
+    const gt_test_descriptor* y = *(const gt_test_descriptor* const*)b;
+    int file = strcmp(x->file, y->file);
+    if (file != 0) {
+        return file;
+    }
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+static int gt_registry_compare_name(const void* a, const void* b)
+{
+    return strcmp(registry.name[*(const uint64_t*)a], registry.name[*(const uint64_t*)b]);
+}
+
+static int gt_registry_matches(const char* filter, const char* name)
+{
+    // colon separated globs, e.g. GT_FILTER="vector_*/null_*:matrix/*".
+    char pattern[512];
+    while (filter != NULL && *filter != '\0') {
+        const char* end = strchr(filter, ':');
+        size_t length = (end != NULL) ? (size_t)(end - filter) : strlen(filter);
+        if (length < sizeof(pattern)) {
+            memcpy(pattern, filter, length);
+            pattern[length] = '\0';
+            if (fnmatch(pattern, name, 0) == 0) {
+                return 1;
+            }
+        }
+        filter = (end != NULL) ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static void gt_registry_load_durations(const char* path, uint64_t* cases, uint64_t case_nb)
+{
+    // lines of "<seconds> <function>/<case>", as written with GT_RECORD_DURATIONS.
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    uint64_t* by_name = gt_alloc(case_nb, sizeof(uint64_t));
+    memcpy(by_name, cases, case_nb * sizeof(uint64_t));
+    qsort(by_name, case_nb, sizeof(uint64_t), gt_registry_compare_name);
+
+    double seconds;
+    char name[512];
+    while (fscanf(file, "%lf %511s", &seconds, name) == 2) {
+        uint64_t low = 0;
+        uint64_t high = case_nb;
+        while (low < high) {
+            uint64_t mid = low + (high - low) / 2;
+            if (strcmp(registry.name[by_name[mid]], name) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low < case_nb && strcmp(registry.name[by_name[low]], name) == 0) {
+            registry.expected[by_name[low]] = seconds;
+        }
+    }
+
+    free(by_name);
+    fclose(file);
+}
+
+static int gt_registry_compare_expected(const void* a, const void* b)
+{
+    // longest first; the source order breaks ties so every shard agrees.
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    if (registry.expected[x] != registry.expected[y]) {
+        return (registry.expected[x] < registry.expected[y]) ? 1 : -1;
+    }
+    return (registry.position[x] > registry.position[y]) - (registry.position[x] < registry.position[y]);
+}
+
+static void gt_registry_shard(uint64_t* cases, uint64_t case_nb, uint64_t shard_index, uint64_t shard_count)
+{
+    // longest processing time first: the next longest case goes to the least loaded shard.
+    double known = 0;
+    uint64_t known_nb = 0;
+    for (uint64_t i = 0; i < case_nb; i++) {
+        if (registry.expected[cases[i]] >= 0) {
+            known += registry.expected[cases[i]];
+            known_nb++;
+        }
+    }
+
+    double fallback = (known_nb > 0) ? known / known_nb : 1;
+    for (uint64_t i = 0; i < case_nb; i++) {
+        if (registry.expected[cases[i]] < 0) {
+            registry.expected[cases[i]] = fallback;
+        }
+    }
+
+    qsort(cases, case_nb, sizeof(uint64_t), gt_registry_compare_expected);
+    double* loads = gt_alloc(shard_count, sizeof(double));
+    for (uint64_t i = 0; i < case_nb; i++) {
+        uint64_t shard = 0;
+        for (uint64_t j = 1; j < shard_count; j++) {
+            shard = (loads[j] < loads[shard]) ? j : shard;
+        }
+        loads[shard] += registry.expected[cases[i]];
+        registry.selected[cases[i]] = (shard == shard_index);
+    }
+    free(loads);
+}
+
+static void gt_registry_record(void)
+{
+    // a worker that exits early leaves the record to the parent.
+    if (runner.worker) {
+        return;
+    }
+
+    FILE* file = fopen(registry.record, "w");
+    if (file == NULL) {
+        perror(registry.record);
+        return;
+    }
+
+    for (uint64_t i = 0; i < registry.count; i++) {
+        if (registry.seconds[i] >= 0) {
+            fprintf(file, "%.6f %s\n", registry.seconds[i], registry.name[i]);
+        }
+    }
+    fclose(file);
+}
+
+static void gt_registry_setup(void)
+{
+    registry.ready = 1;
+    registry.count = (__start_gt_tests != NULL) ? (uint64_t)(__stop_gt_tests - __start_gt_tests) : 0;
+    if (registry.count == 0) {
+        return;
     }
 
-    if ((background >= 40 && background <= 47) || (background > 100 && background < 107)) {
-        printf("\x1b[%im", background);
+    const gt_test_descriptor** sorted = gt_alloc(registry.count, sizeof(gt_test_descriptor*));
+    uint64_t* cases = gt_alloc(registry.count, sizeof(uint64_t));
+    uint64_t case_nb = 0;
+    uint8_t* has_case = gt_alloc(registry.count, sizeof(uint8_t));
+    registry.parent = gt_alloc(registry.count, sizeof(int64_t));
+    registry.position = gt_alloc(registry.count, sizeof(uint64_t));
+    registry.name = gt_alloc(registry.count, sizeof(char*));
+    registry.selected = gt_alloc(registry.count, sizeof(uint8_t));
+    registry.expected = gt_alloc(registry.count, sizeof(double));
+    registry.seconds = gt_alloc(registry.count, sizeof(double));
+    for (uint64_t i = 0; i < registry.count; i++) {
+        sorted[i] = &__start_gt_tests[i];
     }
+    qsort(sorted, registry.count, sizeof(gt_test_descriptor*), gt_registry_compare_source);
 
-    if (reset) {
-        printf("\x1b[0m");
+    const char* filter = getenv("GT_FILTER");
+    int64_t function = -1;
+    for (uint64_t i = 0; i < registry.count; i++) {
+        int64_t index = sorted[i] - __start_gt_tests;
+        registry.position[index] = i;
+        registry.seconds[index] = -1;
+        if (sorted[i]->kind == GT_TEST_FUNCTION) {
+            function = index;
+            registry.parent[index] = -1;
+            registry.name[index] = strdup(sorted[i]->name);
+            continue;
+        }
+
+        if (function >= 0 && strcmp(__start_gt_tests[function].file, sorted[i]->file) != 0) {
+            function = -1;
+        }
+
+        char name[512];
+        snprintf(name, sizeof(name), "%s/%s", (function >= 0) ? __start_gt_tests[function].name : "", sorted[i]->name);
+        registry.parent[index] = function;
+        registry.name[index] = strdup(name);
+        registry.expected[index] = -1;
+        if (function >= 0) {
+            has_case[function] = 1;
+        }
+        if (filter == NULL || gt_registry_matches(filter, name)) {
+            cases[case_nb++] = index;
+            registry.selected[index] = 1;
+        }
+    }
+
+    const char* shard_count = getenv("GT_SHARD_COUNT");
+    const char* shard_index = getenv("GT_SHARD_INDEX");
+    uint64_t count = (shard_count != NULL) ? strtoull(shard_count, NULL, 10) : 1;
+    uint64_t index = (shard_index != NULL) ? strtoull(shard_index, NULL, 10) : 0;
+    if (count == 0 || index >= count) {
+        fprintf(stderr, "GT_SHARD_INDEX (%lu) must be less than GT_SHARD_COUNT (%lu)\n", index, count);
+        exit(EXIT_FAILURE);
+    }
+
+    if (count > 1) {
+        const char* durations = getenv("GT_DURATIONS");
+        if (durations != NULL) {
+            gt_registry_load_durations(durations, cases, case_nb);
+        }
+        gt_registry_shard(cases, case_nb, index, count);
+    }
+
+    // a function runs when one of its cases does; functions without cases only
+    // show up in unfiltered runs of the first shard.
+    for (uint64_t i = 0; i < registry.count; i++) {
+        if (registry.parent[i] >= 0 && registry.selected[i]) {
+            registry.selected[registry.parent[i]] = 1;
+        }
+        if (__start_gt_tests[i].kind == GT_TEST_FUNCTION && !has_case[i] && filter == NULL && index == 0) {
+            registry.selected[i] = 1;
+        }
+    }
+
+    if (getenv("GT_LIST") != NULL) {
+        for (uint64_t i = 0; i < registry.count; i++) {
+            int64_t index = sorted[i] - __start_gt_tests;
+            if (sorted[i]->kind != GT_TEST_FUNCTION && registry.selected[index]) {
+                printf("%s\n", registry.name[index]);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    registry.record = getenv("GT_RECORD_DURATIONS");
+    if (registry.record != NULL) {
+        atexit(gt_registry_record);
     }
+
+    free(has_case);
+    free(cases);
+    free(sorted);
 }
 
-static void gt_print(int foreground, int background, const char* format, ...)
+static int gt_registry_selected(const gt_test_descriptor* descriptor)
 {
-    va_list argv;
-    va_start(argv, format);
-    gt_set_output_color(0, foreground, background);
-    vprintf(format, argv);
-    gt_set_output_color(1, 0, 0);
-    va_end(argv);
+    // the report starts once the list is known, GT_LIST prints only the list.
+    if (!registry.ready) {
+        gt_registry_setup();
+        gt_report_setup();
+    }
+
+    int64_t index = gt_registry_index(descriptor);
+    return (index < 0) || registry.selected[index];
 }
 
-static void gt_println(int foreground, int background, const char* format, ...)
+static void gt_registry_set_seconds(const gt_test_descriptor* descriptor, double seconds)
 {
-    va_list argv;
-    va_start(argv, format);
-    gt_set_output_color(0, foreground, background);
-    vprintf(format, argv);
-    gt_set_output_color(1, 0, 0);
-    putc('\n', stdout);
-    va_end(argv);
+    int64_t index = gt_registry_index(descriptor);
+    if (index >= 0) {
+        registry.seconds[index] = seconds;
+    }
 }
 
-static void gt_print_indent(void)
+static void gt_runner_result(gt_event* event, gt_case_result* result)
 {
-    static const char indent[] = { ' ', ' ', ' ', ' ' };
-    fwrite(indent, 1, sizeof(indent), stdout);
+    // a worker that reached the end of its case appended its result to its output.
+    if (event->length >= sizeof(*result)) {
+        memcpy(result, event->output + event->length - sizeof(*result), sizeof(*result));
+        if (result->magic == GT_RESULT_MAGIC) {
+            event->length -= sizeof(*result);
+            return;
+        }
+    }
+
+    *result = (gt_case_result) { .magic = GT_RESULT_MAGIC };
+    if (event->timed_out) {
+        result->kind = GT_RESULT_TIMEOUT;
+        result->code = runner.timeout;
+    } else if (WIFSIGNALED(event->status)) {
+        result->kind = GT_RESULT_SIGNAL;
+        result->code = WTERMSIG(event->status);
+    } else {
+        result->kind = GT_RESULT_EXIT;
+        result->code = WEXITSTATUS(event->status);
+    }
 }
 
-static void gt_print_generic(gt_generic generic, gt_type type, int fore, int back, void (*print)(int, int, const char*, ...))
+static void gt_runner_flush(void)
 {
-    switch (type) {
-    case GT_TYPE_U_64:
-        print(fore, back, "%lu", generic.u_64);
-        break;
-    case GT_TYPE_S_64:
-        print(fore, back, "%li", generic.s_64);
-        break;
-    case GT_TYPE_F_64:
-        print(fore, back, "%lf", generic.f_64);
-        break;
-    case GT_TYPE_CSTR:
-        print(fore, back, "%s", generic.cstr);
-        break;
-    case GT_TYPE_ADDR:
-        print(fore, back, "%p", generic.addr);
-        break;
-    default:
-        print(fore, back, "invalid type");
+    while (runner.printed < runner.event_nb && runner.events[runner.printed].done) {
+        gt_event* event = &runner.events[runner.printed++];
+        switch (event->kind) {
+        case GT_EVENT_FUNCTION_ENTER:
+            gt_report_function_begin(event->descriptor->name);
+            break;
+        case GT_EVENT_FUNCTION_LEAVE:
+            gt_report_function_end(event->descriptor->name);
+            break;
+        case GT_EVENT_CASE: {
+            gt_case_result result;
+            gt_runner_result(event, &result);
+            gt_report_case_begin(event->descriptor->name);
+            gt_report_case_end(event->descriptor->name, &result, event->output, event->length, event->seconds);
+            free(event->output);
+            event->output = NULL;
+            break;
+        }
+        }
+    }
+}
+
+static gt_event* gt_runner_push(int kind, const gt_test_descriptor* descriptor)
+{
+    if (runner.event_nb == runner.event_cap) {
+        uint64_t capacity = (runner.event_cap > 0) ? runner.event_cap * 2 : 64;
+        gt_event* events = realloc(runner.events, capacity * sizeof(gt_event));
+        if (events == NULL) {
+            gt_fatal("gt_runner_push");
+        }
+        runner.events = events;
+        runner.event_cap = capacity;
+    }
+
+    gt_event* event = &runner.events[runner.event_nb++];
+    *event = (gt_event) { .kind = kind, .descriptor = descriptor, .done = (kind != GT_EVENT_CASE), .fd = -1 };
+    return event;
+}
+
+static ssize_t gt_runner_read(gt_event* event)
+{
+    if (event->capacity - event->length < 4096) {
+        size_t capacity = (event->capacity > 0) ? event->capacity * 2 : 8192;
+        char* output = realloc(event->output, capacity);
+        if (output == NULL) {
+            gt_fatal("gt_runner_read");
+        }
+        event->output = output;
+        event->capacity = capacity;
+    }
+
+    ssize_t size = read(event->fd, event->output + event->length, event->capacity - event->length);
+    if (size > 0) {
+        event->length += size;
+    }
+    return size;
+}
+
+static void gt_runner_reap(gt_event* event)
+{
+    while (waitpid(event->pid, &event->status, 0) < 0 && errno == EINTR) { }
+    event->seconds = gt_seconds_since(&event->start);
+    gt_registry_set_seconds(event->descriptor, event->seconds);
+
+    // what the worker wrote before it ended is still in the pipe.
+    fcntl(event->fd, F_SETFL, O_NONBLOCK);
+    while (gt_runner_read(event) > 0) { }
+    close(event->fd);
+    event->fd = -1;
+    event->done = 1;
+    runner.running--;
+}
+
+static void gt_runner_poll(void)
+{
+    struct pollfd fds[runner.running];
+    uint64_t indexes[runner.running];
+    uint64_t fd_nb = 0;
+    int wait = -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (uint64_t i = runner.printed; i < runner.event_nb; i++) {
+        gt_event* event = &runner.events[i];
+        if (event->kind != GT_EVENT_CASE || event->done) {
+            continue;
+        }
+
+        if (runner.timeout > 0) {
+            int64_t left = (event->deadline.tv_sec - now.tv_sec) * 1000 + (event->deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (left <= 0) {
+                kill(event->pid, SIGKILL);
+                event->timed_out = 1;
+                gt_runner_reap(event);
+                continue;
+            }
+            wait = (wait < 0 || left < wait) ? left : wait;
+        }
+
+        fds[fd_nb] = (struct pollfd) { .fd = event->fd, .events = POLLIN };
+        indexes[fd_nb++] = i;
+    }
+
+    if (fd_nb > 0 && poll(fds, fd_nb, wait) < 0 && errno != EINTR) {
+        gt_fatal("gt_runner_poll");
+    }
+
+    for (uint64_t i = 0; i < fd_nb; i++) {
+        gt_event* event = &runner.events[indexes[i]];
+        if (fds[i].revents == 0) {
+            continue;
+        }
+
+        ssize_t size = gt_runner_read(event);
+        if (size == 0 || (size < 0 && errno != EINTR && errno != EAGAIN)) {
+            gt_runner_reap(event);
+        }
+    }
+
+    gt_runner_flush();
+}
+
+static void gt_runner_drain(void)
+{
+    // a test that calls exit in a worker must not wait for its siblings.
+    if (runner.worker) {
+        return;
+    }
+
+    while (runner.running > 0) {
+        gt_runner_poll();
+    }
+    gt_runner_flush();
+    free(runner.events);
+    runner.events = NULL;
+}
+
+static int gt_runner_parallel(void)
+{
+    if (runner.jobs == 0) {
+        const char* jobs = getenv("GT_JOBS");
+        const char* timeout = getenv("GT_TIMEOUT");
+        runner.jobs = (jobs != NULL) ? strtoull(jobs, NULL, 10) : 1;
+        if (runner.jobs == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            runner.jobs = (cpus > 0) ? cpus : 1;
+        }
+        runner.timeout = (timeout != NULL) ? strtoull(timeout, NULL, 10) : 60;
+        if (runner.jobs > 1) {
+            atexit(gt_runner_drain);
+        }
+    }
+
+    return runner.jobs > 1 && !runner.worker;
+}
+
+static int gt_runner_spawn(const gt_test_descriptor* descriptor)
+{
+    while (runner.running >= runner.jobs) {
+        gt_runner_poll();
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        gt_fatal("pipe");
+    }
+
+    uint64_t index = runner.event_nb;
+    gt_runner_push(GT_EVENT_CASE, descriptor);
+    gt_report_flush();
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        gt_fatal("fork");
     }
+
+    if (pid == 0) {
+        runner.worker = 1;
+        report.length = 0;
+        for (uint64_t i = runner.printed; i < index; i++) {
+            if (runner.events[i].fd >= 0) {
+                close(runner.events[i].fd);
+            }
+        }
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        return GT_LOOP_ENTER;
+    }
+
+    close(fds[1]);
+    gt_event* event = &runner.events[index];
+    event->pid = pid;
+    event->fd = fds[0];
+    clock_gettime(CLOCK_MONOTONIC, &event->start);
+    event->deadline = event->start;
+    event->deadline.tv_sec += runner.timeout;
+    runner.running++;
+    return GT_LOOP_LEAVE;
 }
 
 gt_generic gt_explicit_genericof_u_64(uint64_t u_64)
@@ -133,86 +1640,426 @@ gt_generic gt_explicit_genericof_vptr(const void* ptr)
     return (gt_generic) { .addr = ptr };
 }
 
-int gt_explicit_test_function(const char* name)
+int gt_explicit_test_function(const gt_test_descriptor* descriptor)
 {
     static int mode = GT_LOOP_LEAVE;
+    const char* name = descriptor->name;
 
     if (mode == GT_LOOP_LEAVE) {
+        // filtered out or on another shard, the whole block is skipped.
+        if (!gt_registry_selected(descriptor)) {
+            return GT_LOOP_LEAVE;
+        }
+
         mode = GT_LOOP_ENTER;
-        global.Function.name = name;
-        global.Function.failure_nb = 0;
-        global.Function.success_nb = 0;
-        gt_println(33, 0, "%s", name);
+        if (gt_runner_parallel()) {
+            gt_runner_push(GT_EVENT_FUNCTION_ENTER, descriptor);
+            gt_runner_flush();
+            return mode;
+        }
+        gt_report_function_begin(name);
     } else {
         mode = GT_LOOP_LEAVE;
-        gt_print_indent();
-        if (global.Function.failure_nb == 0 && global.Function.success_nb > 0) {
-            gt_println(36, 0, "%lu test case passed", global.Function.success_nb);
-        } else if (global.Function.failure_nb > 0 && global.Function.success_nb > 0) {
-            gt_println(36, 0, "%lu test case passed, %lu test case failed", global.Function.success_nb, global.Function.failure_nb);
-        } else if (global.Function.failure_nb > 0 && global.Function.success_nb == 0) {
-            gt_println(36, 0, "%lu test case failed", global.Function.failure_nb);
-        } else {
-            gt_print(33, 0, "%s ", name);
-            gt_println(0, 0, " skipped");
+        if (gt_runner_parallel()) {
+            gt_runner_push(GT_EVENT_FUNCTION_LEAVE, descriptor);
+            gt_runner_flush();
+            return mode;
         }
+        gt_report_function_end(name);
     }
 
     return mode;
 }
 
-int gt_explicit_test_case(const char* name)
+int gt_explicit_test_case(const gt_test_descriptor* descriptor)
 {
     static int mode = GT_LOOP_LEAVE;
-    static uint64_t length = 0;
+    static struct timespec start;
+    const char* name = descriptor->name;
 
     if (mode == GT_LOOP_LEAVE) {
+        if (!gt_registry_selected(descriptor)) {
+            return GT_LOOP_LEAVE;
+        }
+
+        // the parent skips the body, a worker runs it.
+        if (gt_runner_parallel() && gt_runner_spawn(descriptor) == GT_LOOP_LEAVE) {
+            return GT_LOOP_LEAVE;
+        }
+
         mode = GT_LOOP_ENTER;
         global.Case.name = name;
         global.Case.result = GT_LOOP_ENTER;
-        length = strlen(name);
-        gt_print_indent();
-        gt_print(33, 0, "%s ", name);
-        for (uint64_t i = 0; i < (30 - length); i++) {
-            gt_print(0, 0, ".");
+        global.Case.site_error = 0;
+        if (!runner.worker) {
+            gt_report_case_begin(name);
+            gt_capture_begin();
         }
-
+        clock_gettime(CLOCK_MONOTONIC, &start);
     } else {
         mode = GT_LOOP_LEAVE;
-        if (global.Case.result == GT_LOOP_ENTER) {
-            gt_println(30, 102, "PASS");
-            global.Function.success_nb++;
-        } else {
-            gt_println(30, 101, "FAIL");
-            gt_print_indent();
-            gt_print_indent();
-            gt_println(0, 0, "file: %s", global.Assert.file);
-            gt_print_indent();
-            gt_print_indent();
-            gt_println(0, 0, "line: %u", global.Assert.line);
-            gt_print_indent();
-            gt_print_indent();
-            gt_println(0, 0, "expr: %s %s %s", global.Assert.A.expression, gt_op[global.Assert.mode], global.Assert.B.expression);
-            gt_print_indent();
-            gt_print_indent();
-            gt_print(0, 0, "-> %s = ", global.Assert.A.expression);
-            gt_print_generic(global.Assert.A.generic, global.Assert.A.type, 91, 0, gt_println);
-            gt_print_indent();
-            gt_print_indent();
-            gt_print(0, 0, "-> %s = ", global.Assert.B.expression);
-            gt_print_generic(global.Assert.B.generic, global.Assert.B.type, 91, 0, gt_println);
-            global.Function.failure_nb++;
+        double seconds = gt_seconds_since(&start);
+        size_t length;
+        const char* output = gt_capture_end(&length);
+        gt_registry_set_seconds(descriptor, seconds);
+        gt_clear_active_mocks();
+
+        gt_case_result result;
+        gt_case_result_of_assert(&result);
+        if (runner.worker) {
+            fflush(stdout);
+            fflush(stderr);
+            if (write(STDOUT_FILENO, &result, sizeof(result)) != sizeof(result)) {
+                _exit(GT_RESULT_LOST);
+            }
+            _exit(EXIT_SUCCESS);
         }
+        gt_report_case_end(name, &result, output, length, seconds);
     }
 
     return mode;
 }
 
+int gt_exit_status(void)
+{
+    // the cases still running in workers count too.
+    if (!runner.worker) {
+        while (runner.running > 0) {
+            gt_runner_poll();
+        }
+        gt_runner_flush();
+    }
+    return (report.failure_nb > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// a benchmark warms up while it doubles its batch until one batch takes about
+// GT_BENCH_TIME / GT_BENCH_SAMPLES, then times GT_BENCH_SAMPLES batches of that size.
+#define GT_BENCH_BATCH_MAX (1ull << 40)
+
+enum {
+    GT_BENCH_WARMUP,
+    GT_BENCH_SAMPLE,
+};
+
+static struct {
+    int mode;
+    int phase;
+    uint64_t batch;
+    uint64_t sample_nb;
+    uint64_t sample_max;
+    double target;
+    double warmup;
+    double* samples;
+    double threshold;
+    double alpha;
+    FILE* save;
+    struct timespec start;
+    struct timespec batch_start;
+} bench = { .mode = GT_LOOP_LEAVE };
+
+// the samples of every benchmark of a previous run, written with GT_BENCH_SAVE:
+// a "gt-bench 1" line, then "<function>/<bench> <count> <samples...>" lines.
+#define GT_BASELINE_HEADER "gt-bench 1"
+
+static struct {
+    char** name;
+    double** samples;
+    uint64_t* sample_nb;
+    uint64_t count;
+} baseline = { 0 };
+
+static double gt_nanoseconds_between(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static int gt_compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void gt_baseline_load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char header[32];
+    if (fgets(header, sizeof(header), file) == NULL || strncmp(header, GT_BASELINE_HEADER, strlen(GT_BASELINE_HEADER)) != 0) {
+        fprintf(stderr, "%s is not a benchmark baseline\n", path);
+        fclose(file);
+        return;
+    }
+
+    char name[512];
+    uint64_t sample_nb;
+    uint64_t capacity = 0;
+    while (fscanf(file, "%511s %lu", name, &sample_nb) == 2 && sample_nb > 0 && sample_nb <= (1u << 20)) {
+        double* samples = gt_alloc(sample_nb, sizeof(double));
+        uint64_t read = 0;
+        while (read < sample_nb && fscanf(file, "%lf", &samples[read]) == 1) {
+            read++;
+        }
+        if (read != sample_nb) {
+            // the rest of the file is out of step with the entries, it is not read.
+            fprintf(stderr, "%s: %s has %lu of its %lu samples, it is ignored\n", path, name, read, sample_nb);
+            free(samples);
+            break;
+        }
+        // the comparison expects the samples in order, as a run keeps them.
+        qsort(samples, sample_nb, sizeof(double), gt_compare_double);
+
+        if (baseline.count == capacity) {
+            capacity = (capacity > 0) ? capacity * 2 : 16;
+            char** names = realloc(baseline.name, capacity * sizeof(char*));
+            double** samples = realloc(baseline.samples, capacity * sizeof(double*));
+            uint64_t* counts = realloc(baseline.sample_nb, capacity * sizeof(uint64_t));
+            baseline.name = (names != NULL) ? names : baseline.name;
+            baseline.samples = (samples != NULL) ? samples : baseline.samples;
+            baseline.sample_nb = (counts != NULL) ? counts : baseline.sample_nb;
+            if (names == NULL || samples == NULL || counts == NULL) {
+                gt_fatal("gt_baseline_load");
+            }
+        }
+
+        baseline.name[baseline.count] = strdup(name);
+        baseline.samples[baseline.count] = samples;
+        baseline.sample_nb[baseline.count] = sample_nb;
+        baseline.count++;
+    }
+    fclose(file);
+}
+
+static int64_t gt_baseline_find(const char* name)
+{
+    for (uint64_t i = 0; i < baseline.count; i++) {
+        if (strcmp(baseline.name[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    double value;
+    int current;
+} gt_ranked_sample;
+
+static int gt_compare_ranked_sample(const void* a, const void* b)
+{
+    return gt_compare_double(&((const gt_ranked_sample*)a)->value, &((const gt_ranked_sample*)b)->value);
+}
+
+static double gt_mann_whitney(const double* before, uint64_t before_nb, const double* after, uint64_t after_nb)
+{
+    // one sided mann-whitney u test with the normal approximation: the chance to
+    // draw samples this much slower than the baseline when nothing changed.
+    uint64_t count = before_nb + after_nb;
+    gt_ranked_sample* all = gt_alloc(count, sizeof(gt_ranked_sample));
+    for (uint64_t i = 0; i < before_nb; i++) {
+        all[i] = (gt_ranked_sample) { before[i], 0 };
+    }
+    for (uint64_t i = 0; i < after_nb; i++) {
+        all[before_nb + i] = (gt_ranked_sample) { after[i], 1 };
+    }
+    qsort(all, count, sizeof(gt_ranked_sample), gt_compare_ranked_sample);
+
+    // equal samples share the mean of their ranks.
+    double rank_sum = 0;
+    double ties = 0;
+    for (uint64_t i = 0; i < count;) {
+        uint64_t j = i;
+        while (j < count && all[j].value == all[i].value) {
+            j++;
+        }
+        double rank = (i + 1 + j) / 2.0;
+        for (uint64_t k = i; k < j; k++) {
+            rank_sum += all[k].current ? rank : 0;
+        }
+        double tied = j - i;
+        ties += tied * tied * tied - tied;
+        i = j;
+    }
+    free(all);
+
+    double u = rank_sum - after_nb * (after_nb + 1) / 2.0;
+    double mean = before_nb * after_nb / 2.0;
+    double variance = before_nb * after_nb / 12.0 * ((count + 1) - ties / ((double)count * (count - 1)));
+    if (variance <= 0) {
+        return 1;
+    }
+    double z = (u - mean - 0.5) / sqrt(variance);
+    return 0.5 * erfc(z / sqrt(2));
+}
+
+static void gt_baseline_compare(const char* name, const gt_test_descriptor* descriptor, gt_bench_result* result)
+{
+    int64_t index = gt_baseline_find(name);
+    if (index < 0) {
+        return;
+    }
+
+    // the baseline samples are sorted, as written.
+    const double* samples = baseline.samples[index];
+    uint64_t count = baseline.sample_nb[index];
+    double median = (count % 2) ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    result->compared = 1;
+    result->threshold = (descriptor->threshold > 0) ? descriptor->threshold : bench.threshold;
+    result->change = (median > 0) ? (result->median - median) / median : 0;
+    result->p_value = gt_mann_whitney(samples, count, bench.samples, bench.sample_nb);
+    result->regressed = (result->p_value < bench.alpha && result->change > result->threshold);
+}
+
+static void gt_baseline_save(const char* name)
+{
+    if (bench.save == NULL) {
+        return;
+    }
+
+    // flushed at once, a forked worker has nothing left to write twice.
+    fprintf(bench.save, "%s %lu", name, bench.sample_nb);
+    for (uint64_t i = 0; i < bench.sample_nb; i++) {
+        fprintf(bench.save, " %.6g", bench.samples[i]);
+    }
+    fputc('\n', bench.save);
+    fflush(bench.save);
+}
+
+static void gt_bench_setup(void)
+{
+    const char* samples = getenv("GT_BENCH_SAMPLES");
+    const char* time = getenv("GT_BENCH_TIME");
+    const char* warmup = getenv("GT_BENCH_WARMUP");
+    bench.sample_max = (samples != NULL) ? strtoull(samples, NULL, 10) : 100;
+    bench.sample_max = (bench.sample_max > 0) ? bench.sample_max : 1;
+    bench.target = ((time != NULL) ? strtod(time, NULL) : 0.1) * 1e9 / bench.sample_max;
+    bench.warmup = ((warmup != NULL) ? strtod(warmup, NULL) : 0.05) * 1e9;
+    bench.samples = gt_alloc(bench.sample_max, sizeof(double));
+
+    // the baseline is read before the results are saved, the file can be the same.
+    const char* threshold = getenv("GT_BENCH_THRESHOLD");
+    const char* alpha = getenv("GT_BENCH_ALPHA");
+    const char* load = getenv("GT_BENCH_BASELINE");
+    const char* save = getenv("GT_BENCH_SAVE");
+    bench.threshold = (threshold != NULL) ? strtod(threshold, NULL) : 0.05;
+    bench.alpha = (alpha != NULL) ? strtod(alpha, NULL) : 0.01;
+    if (load != NULL) {
+        gt_baseline_load(load);
+    }
+    if (save != NULL) {
+        bench.save = fopen(save, "w");
+        if (bench.save == NULL) {
+            perror(save);
+        } else {
+            fprintf(bench.save, "%s\n", GT_BASELINE_HEADER);
+            fflush(bench.save);
+        }
+    }
+}
+
+static void gt_bench_result_of_samples(gt_bench_result* result)
+{
+    uint64_t count = bench.sample_nb;
+    double sum = 0;
+    qsort(bench.samples, count, sizeof(double), gt_compare_double);
+    for (uint64_t i = 0; i < count; i++) {
+        sum += bench.samples[i];
+    }
+
+    uint64_t p99 = (count * 99 + 99) / 100;
+    result->sample_nb = count;
+    result->iterations = bench.batch;
+    result->min = bench.samples[0];
+    result->median = (count % 2) ? bench.samples[count / 2] : (bench.samples[count / 2 - 1] + bench.samples[count / 2]) / 2;
+    result->mean = sum / count;
+    result->p99 = bench.samples[(p99 > 0) ? p99 - 1 : 0];
+    result->compared = 0;
+    result->regressed = 0;
+}
+
+int gt_explicit_bench(const gt_test_descriptor* descriptor, uint64_t* iterations)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const char* name = descriptor->name;
+
+    if (bench.mode == GT_LOOP_LEAVE) {
+        if (!gt_registry_selected(descriptor)) {
+            return GT_LOOP_LEAVE;
+        }
+
+        // benchmarks run in this process once every worker is done, so
+        // nothing else competes for the cpu and the report stays in order.
+        if (gt_runner_parallel()) {
+            while (runner.running > 0) {
+                gt_runner_poll();
+            }
+            gt_runner_flush();
+        }
+
+        if (bench.samples == NULL) {
+            gt_bench_setup();
+        }
+
+        bench.mode = GT_LOOP_ENTER;
+        bench.phase = GT_BENCH_WARMUP;
+        bench.batch = 1;
+        bench.sample_nb = 0;
+        global.Case.name = name;
+        global.Case.result = GT_LOOP_ENTER;
+        global.Case.site_error = 0;
+        gt_report_case_begin(name);
+        clock_gettime(CLOCK_MONOTONIC, &bench.start);
+    } else {
+        double elapsed = gt_nanoseconds_between(&bench.batch_start, &now);
+        if (bench.phase == GT_BENCH_WARMUP) {
+            if (gt_nanoseconds_between(&bench.start, &now) >= bench.warmup) {
+                double batch = (elapsed > 0) ? bench.batch * bench.target / elapsed : bench.batch * 2.0;
+                batch = (batch < GT_BENCH_BATCH_MAX) ? batch : GT_BENCH_BATCH_MAX;
+                bench.batch = (batch > 1) ? (uint64_t)batch : 1;
+                bench.phase = GT_BENCH_SAMPLE;
+            } else if (elapsed < bench.target && bench.batch < GT_BENCH_BATCH_MAX) {
+                bench.batch *= 2;
+            }
+        } else {
+            bench.samples[bench.sample_nb++] = elapsed / bench.batch;
+        }
+
+        if (bench.sample_nb == bench.sample_max) {
+            bench.mode = GT_LOOP_LEAVE;
+            gt_clear_active_mocks();
+
+            gt_bench_result result;
+            double seconds = gt_nanoseconds_between(&bench.start, &now) / 1e9;
+            gt_bench_result_of_samples(&result);
+            int64_t index = gt_registry_index(descriptor);
+            const char* full_name = (index >= 0) ? registry.name[index] : name;
+            gt_baseline_compare(full_name, descriptor, &result);
+            gt_baseline_save(full_name);
+            gt_registry_set_seconds(descriptor, seconds);
+            gt_report_bench_end(name, &result, seconds);
+            return GT_LOOP_LEAVE;
+        }
+    }
+
+    *iterations = bench.batch;
+    clock_gettime(CLOCK_MONOTONIC, &bench.batch_start);
+    return GT_LOOP_ENTER;
+}
+
 int gt_explicit_assert(gt_expression a, gt_mode mode, gt_expression b, const char* file, unsigned line)
 {
     int assert_condition[GT_MODE_NUMBR] = { 0 };
     int string_comapre = 0;
 
+    // a mock that could not be armed leaves the case at its next assertion.
+    if (global.Case.site_error != 0) {
+        return (global.Case.result = GT_LOOP_LEAVE);
+    }
+
     switch (a.type) {
     case GT_TYPE_ADDR:
     case GT_TYPE_U_64:
@@ -269,24 +2116,75 @@ void gt_explicit_set_mock(void* function_ptr, void* mock_ptr, void* data)
     gt_hijack = function_ptr;
     gt_mock = mock_ptr;
     gt_data = data;
+
+    gt_mock_slot* slot = gt_find_slot(function_ptr);
+    if (slot != NULL) {
+        if (slot->mock == NULL) {
+            if (mocks.active_nb < GT_ACTIVE_MOCK_MAX) {
+                mocks.active[mocks.active_nb] = slot;
+            }
+            mocks.active_nb++;
+        }
+        gt_set_slot(slot, mock_ptr, data);
+        mocks.last = slot;
+    }
+}
+
+void gt_explicit_clear_mock(void* function_ptr)
+{
+    if (gt_hijack == function_ptr) {
+        gt_hijack = NULL;
+        gt_mock = NULL;
+        gt_data = NULL;
+    }
+
+    gt_mock_slot* slot = gt_find_slot(function_ptr);
+    if (slot != NULL) {
+        gt_set_slot(slot, NULL, NULL);
+        mocks.last = (mocks.last == slot) ? NULL : mocks.last;
+    }
+}
+
+void* gt_explicit_get_data(void* function_ptr)
+{
+    gt_mock_slot* slot = gt_find_slot(function_ptr);
+    return (slot != NULL) ? slot->data : gt_data;
+}
+
+void gt_explicit_arm_site(void* function_ptr)
+{
+    gt_mock_slot* slot = gt_find_slot(function_ptr);
+    if (slot != NULL) {
+        gt_write_site(slot, 1);
+    }
 }
 
-void* gt_explicit_get_data(void)
+void gt_explicit_disarm_site(void* function_ptr)
 {
-    return gt_data;
+    gt_mock_slot* slot = gt_find_slot(function_ptr);
+    if (slot != NULL) {
+        gt_write_site(slot, 0);
+    }
 }
 
 int gt_explicit_unmocked_section(void** mock)
 {
     static int mode = GT_LOOP_LEAVE;
 
+    // suspends the last mock that was set, the real function runs meanwhile.
     if (mode == GT_LOOP_LEAVE) {
         mode = GT_LOOP_ENTER;
         *mock = gt_mock;
         gt_mock = NULL;
+        if (mocks.last != NULL) {
+            __atomic_store_n(&mocks.last->mock, NULL, __ATOMIC_RELEASE);
+        }
     } else {
         mode = GT_LOOP_LEAVE;
         gt_mock = *mock;
+        if (mocks.last != NULL) {
+            __atomic_store_n(&mocks.last->mock, *mock, __ATOMIC_RELEASE);
+        }
     }
 
     return mode;
@@ -306,3 +2204,8 @@ const char* gt_function_main_symbol_name(void)
 {
     return "gt_test_main";
 }
+
+const char* gt_patch_table_symbol_name(void)
+{
+    return gt_symbol_name(gt_patch_table);
+}
@@ -77,13 +77,60 @@ enum {
     GT_LOOP_LEAVE,
 };
 
-int gt_explicit_test_function(const char* name);
+enum {
+    GT_TEST_FUNCTION,
+    GT_TEST_CASE,
+    GT_TEST_BENCH,
+};
+
+// every test function and case places one descriptor in the gt_tests section,
+// so the runner can list, filter and shard them before gt_test_main runs.
+typedef struct {
+    uint32_t kind;
+    uint32_t order;
+    const char* name;
+    const char* file;
+    uint64_t line;
+    double threshold;
+} gt_test_descriptor;
+
+#define GT_TEST_DESCRIPTOR(kind, name, threshold)                                                          \
+    ({                                                                                                     \
+        static gt_test_descriptor gt_descriptor __attribute__((used, section("gt_tests"), aligned(8))) = { \
+            kind, __COUNTER__, name, __FILE__, __LINE__, threshold                                         \
+        };                                                                                                 \
+        &gt_descriptor;                                                                                    \
+    })
+
+int gt_explicit_test_function(const gt_test_descriptor* descriptor);
 #define gt_test_function(function) \
-    while (gt_explicit_test_function(#function) == GT_LOOP_ENTER)
+    while (gt_explicit_test_function(GT_TEST_DESCRIPTOR(GT_TEST_FUNCTION, #function, 0)) == GT_LOOP_ENTER)
 
-int gt_explicit_test_case(const char* name);
+int gt_explicit_test_case(const gt_test_descriptor* descriptor);
 #define gt_test_case(name) \
-    while (gt_explicit_test_case(#name) == GT_LOOP_ENTER)
+    while (gt_explicit_test_case(GT_TEST_DESCRIPTOR(GT_TEST_CASE, #name, 0)) == GT_LOOP_ENTER)
+
+// the runtime hands out batches of iterations and times each batch; the body runs
+// once per iteration. threshold is the slowdown of the median tolerated against
+// the baseline, e.g. 0.1 for 10%; 0 uses GT_BENCH_THRESHOLD.
+int gt_explicit_bench(const gt_test_descriptor* descriptor, uint64_t* iterations);
+#define gt_bench_wthreshold(name, threshold)                                                                       \
+    for (uint64_t gt_iterations = 0;                                                                               \
+         gt_explicit_bench(GT_TEST_DESCRIPTOR(GT_TEST_BENCH, #name, threshold), &gt_iterations) == GT_LOOP_ENTER;) \
+        while (gt_iterations-- > 0)
+
+#define gt_bench(name) \
+    gt_bench_wthreshold(name, 0)
+
+// keeps the compiler from dropping a value that is never used; pass the
+// address of an input to keep it from being folded out of the loop.
+#define gt_do_not_optimize(value)                           \
+    ({                                                      \
+        __typeof__(value) gt_value = (value);               \
+        __asm__ volatile("" : : "r"(&gt_value) : "memory"); \
+    })
+
+#define gt_clobber_memory() __asm__ volatile("" : : : "memory")
 
 int gt_explicit_assert(gt_expression a, gt_mode mode, gt_expression b, const char* file, unsigned line);
 #define gt_assert(a, mode, b)                                                                     \
@@ -100,15 +147,58 @@ void gt_explicit_set_mock(void* function_ptr, void* mock_ptr, void* data);
 #define gt_set_mock(function, data) \
     gt_explicit_set_mock(function, GT_MOCK_OF(function), data)
 
+void gt_explicit_clear_mock(void* function_ptr);
+#define gt_clear_mock(function) \
+    gt_explicit_clear_mock(function)
+
+// a site skips the mock check until it is armed; set_mock arms it and
+// clearing the mock disarms it.
+void gt_explicit_arm_site(void* function_ptr);
+#define gt_arm_site(function) \
+    gt_explicit_arm_site(function)
+
+void gt_explicit_disarm_site(void* function_ptr);
+#define gt_disarm_site(function) \
+    gt_explicit_disarm_site(function)
+
 int gt_explicit_unmocked_section(void** mock);
 #define gt_unmocked_section(mock) \
     while (gt_explicit_unmocked_section(mock) == GT_LOOP_ENTER)
 
-void* gt_explicit_get_data(void);
+void* gt_explicit_get_data(void* function_ptr);
 #define GT_STRUCT_OF(function) struct gt_structof_##function
 #define gt_get_data(function) \
-    (GT_STRUCT_OF(function)*)gt_explicit_get_data()
+    ((GT_STRUCT_OF(function)*)gt_explicit_get_data(function))
+
+// EXIT_FAILURE once a case failed or a benchmark regressed, for gt_test_main
+// to return; with GT_JOBS, the running cases are waited for first.
+int gt_exit_status(void);
 
 const char* gt_function_hijack_symbol_name(void);
 const char* gt_function_mock_symbol_name(void);
 const char* gt_function_main_symbol_name(void);
+const char* gt_patch_table_symbol_name(void);
+
+// mock slots, one per patched function; the patcher fills gt_patch_table
+// with offsets relative to itself. sites are sorted function offsets.
+#define GT_PATCH_TABLE_MAGIC 0x32656c6261747467ull
+
+typedef struct {
+    void* mock;
+    void* data;
+} gt_mock_slot;
+
+// the two bytes at entry of the function; equal when the site cannot be disarmed.
+typedef struct {
+    uint32_t entry;
+    uint16_t armed;
+    uint16_t disarmed;
+} gt_patch_toggle;
+
+typedef struct {
+    uint64_t magic;
+    int64_t sites;
+    int64_t slots;
+    int64_t toggles;
+    uint64_t count;
+} gt_patch_descriptor;
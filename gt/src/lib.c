@@ -3,28 +3,108 @@
 */
 
 #include "lib.h"
+#include "utils.h"
 #include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
-#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    Elf64_Shdr* sym_sh;
+    const uint8_t* symbols;
+    size_t entsize;
+    const char* strtab;
+    uint32_t* slots;
+    uint32_t* hashes;
+    size_t mask;
+} elf_sym_index;
+
+typedef struct {
+    Elf64_Shdr* shstrtab_sh;
+    const char* shstrtab;
+    uint32_t* names;
+    uint32_t* name_hashes;
+    uint32_t* types;
+    size_t mask;
+} elf_shdr_index;
+
+typedef struct {
+    size_t offset;
+    size_t size;
+} elf_range;
+
+typedef struct {
+    Elf64_Addr vaddr;
+    size_t offset;
+    size_t filesz;
+} elf_segment;
+
+// segments added past the end of the file, each one takes a spare program header.
+#define ELF_APPENDED_MAX 4
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    uint8_t* data;
+} elf_appended;
 
-static struct {
-    elf_trace trace;
+struct elf_context {
     char path[PATH_MAX];
     uint8_t* data;
     size_t size;
-} elfpv = { 0 };
+    elf_load_mode mode;
+    struct stat source;
+    pthread_mutex_t lock;
+    elf_range* dirty;
+    size_t dirty_num;
+    size_t dirty_max;
+    elf_sym_index symindex;
+    elf_shdr_index shdrindex;
+    elf_func_table functable;
+    void* functable_block;
+    elf_segment* segments;
+    elf_segment* segments_by_offset;
+    size_t segment_num;
+    elf_appended appended[ELF_APPENDED_MAX];
+    size_t appended_num;
+    Elf64_Addr append_vaddr;
+};
+
+// each thread works on the context it bound, the process-wide one by default.
+static elf_context elf_main_context = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static _Thread_local elf_context* elfctx = &elf_main_context;
+
+// failures are traced per thread, whichever context they come from.
+static _Thread_local elf_trace elftrace = { 0 };
+
+static uint32_t elf_hash_name(const char* name)
+{
+    // same function as the one used by .gnu.hash
+    uint32_t hash = 5381;
+    for (; *name != '\0'; name++) {
+        hash = hash * 33 + (uint8_t)*name;
+    }
+    return hash;
+}
 
 // static void elf_dump_trace(void)
 // {
 //     char dump_filename[20] = { 0 };
-//     snprintf(dump_filename, sizeof(dump_filename), "%li", elfpv.trace.timestamp);
+//     snprintf(dump_filename, sizeof(dump_filename), "%li", elfctx->trace.timestamp);
 //
 //     FILE* dump = fopen(dump_filename, "a+");
 //     elf_print_to_file_error_trace(dump);
 //     fclose(dump);
 //
-//     elfpv.trace.length = 0;
-//     memset(elfpv.trace.trace, 0, sizeof(elfpv.trace.trace));
+//     elfctx->trace.length = 0;
+//     memset(elfctx->trace.trace, 0, sizeof(elfctx->trace.trace));
 // }
 
 int elf_reset_index_iterator(elf_index_iterator* iterator_ref)
@@ -41,35 +121,28 @@ int elf_reset_index_iterator(elf_index_iterator* iterator_ref)
 
 int elf_stack_error_struct(elf_error error)
 {
-    if (elfpv.trace.old) {
-        elfpv.trace.length = 0;
-        elfpv.trace.old = 0;
-        time(&elfpv.trace.timestamp);
-    }
-
-    if (elfpv.trace.length < ELF_TRACE_SIZE) {
-        size_t* i = &elfpv.trace.length;
-        elfpv.trace.trace[*i] = error;
-        (*i)++;
-        (*i) = (*i) % ELF_TRACE_SIZE;
-    }
-
+    elftrace.trace[elftrace.head] = error;
+    elftrace.head = (elftrace.head + 1) % ELF_TRACE_SIZE;
+    elftrace.length++;
+    elftrace.errors += (error.code != ELF_OK);
     return error.code;
 }
 
 int elf_has_error(void)
 {
-    for (size_t i = 0; i < elfpv.trace.length; i++) {
-        if (elfpv.trace.trace[i].code != ELF_OK)
-            return 1;
-    }
+    return elftrace.errors != 0;
+}
 
-    return 0;
+size_t elf_error_count(void)
+{
+    return elftrace.errors;
 }
 
 void elf_reset_error_trace(void)
 {
-    elfpv.trace.old = 1;
+    elftrace.head = 0;
+    elftrace.length = 0;
+    elftrace.errors = 0;
 }
 
 void elf_print_to_file_error_trace(FILE* output)
@@ -78,77 +151,367 @@ void elf_print_to_file_error_trace(FILE* output)
         return;
     }
 
-    for (size_t i = 0; i < elfpv.trace.length; i++) {
-        fprintf(output, "%zu: %i\n", i, elfpv.trace.trace[i].code);
-        fprintf(output, "\tfile: %s\n", elfpv.trace.trace[i].file);
-        fprintf(output, "\tfunc: %s\n", elfpv.trace.trace[i].func);
-        fprintf(output, "\tline: %i\n\n", elfpv.trace.trace[i].line);
+    // oldest entry first; older ones were overwritten by the ring.
+    size_t kept = (elftrace.length < ELF_TRACE_SIZE) ? elftrace.length : ELF_TRACE_SIZE;
+    size_t first = (elftrace.head + ELF_TRACE_SIZE - kept) % ELF_TRACE_SIZE;
+    for (size_t i = 0; i < kept; i++) {
+        elf_error* error = &elftrace.trace[(first + i) % ELF_TRACE_SIZE];
+        fprintf(output, "%zu: %i\n", elftrace.length - kept + i, error->code);
+        fprintf(output, "\tfile: %s\n", error->file);
+        fprintf(output, "\tfunc: %s\n", error->func);
+        fprintf(output, "\tline: %i\n\n", error->line);
     }
 }
 
 int elf_elf_loaded(void)
 {
-    return elfpv.data != NULL;
+    return elfctx->data != NULL;
+}
+
+static int elf_read_elf(int fd)
+{
+    elfctx->data = malloc(elfctx->size);
+    if (elfctx->data == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    size_t done = 0;
+    while (done < elfctx->size) {
+        ssize_t result = read(fd, elfctx->data + done, elfctx->size - done);
+        if (result <= 0) {
+            free(elfctx->data);
+            elfctx->data = NULL;
+            return elf_stack_error(ELF_ERR_PATH);
+        }
+        done += result;
+    }
+
+    elfctx->mode = ELF_LOAD_READ;
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_map_elf(int fd)
+{
+    // private mapping: patched pages are copied on write, the file is never modified.
+    // not traced: the caller reads the file instead, and traces only if that fails too.
+    void* data = mmap(NULL, elfctx->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return ELF_ERR_MALLOC;
+    }
+
+    // sections are visited out of order, readahead would page in debug info for nothing.
+    madvise(data, elfctx->size, MADV_RANDOM);
+
+    // the section header table is read by almost every accessor.
+    Elf64_Ehdr* hdr = data;
+    if (elfctx->size >= sizeof(*hdr) && hdr->e_shoff < elfctx->size) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = hdr->e_shoff & ~(page - 1);
+        size_t length = (size_t)hdr->e_shentsize * hdr->e_shnum;
+        if (length > elfctx->size - hdr->e_shoff) {
+            length = elfctx->size - hdr->e_shoff;
+        }
+        madvise((uint8_t*)data + start, hdr->e_shoff - start + length, MADV_WILLNEED);
+    }
+
+    elfctx->data = data;
+    elfctx->mode = ELF_LOAD_MMAP;
+    return elf_stack_error(ELF_OK);
 }
 
 int elf_load_elf(const char* path)
+{
+    elf_check(elf_load_elf_wmode(path, ELF_LOAD_MMAP));
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_load_elf_wmode(const char* path, elf_load_mode mode)
 {
     if (elf_elf_loaded()) {
         return elf_stack_error(ELF_ERR_LOADED);
     }
 
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         return elf_stack_error(ELF_ERR_PATH);
     }
 
-    fseek(file, 0, SEEK_END);
-    elfpv.size = ftell(file);
-    rewind(file);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return elf_stack_error(ELF_ERR_PATH);
+    }
 
-    elfpv.data = malloc(elfpv.size);
-    if (elfpv.data == NULL) {
-        fclose(file);
-        return elf_stack_error(ELF_ERR_MALLOC);
+    elfctx->size = st.st_size;
+    elfctx->source = st;
+
+    // falls back to reading the file when it cannot be mapped.
+    int error = ELF_ERR_OPTION;
+    if (mode == ELF_LOAD_MMAP) {
+        error = elf_map_elf(fd);
     }
+    if (error != ELF_OK) {
+        error = elf_read_elf(fd);
+    }
+
+    close(fd);
+    if (error != ELF_OK) {
+        elfctx->size = 0;
+        return elf_stack_error(error);
+    }
+
+    strncpy(elfctx->path, path, PATH_MAX - 1);
 
-    strncpy(elfpv.path, path, PATH_MAX);
-    fread(elfpv.data, 1, elfpv.size, file);
-    fclose(file);
+    // not fatal: malformed files can still be inspected, lookups report the error.
+    elf_build_shdr_index();
     return elf_stack_error(ELF_OK);
 }
 
+static void elf_release_context(elf_context* context)
+{
+    free(context->symindex.slots);
+    free(context->symindex.hashes);
+    memset(&context->symindex, 0, sizeof(context->symindex));
+    free(context->shdrindex.names);
+    free(context->shdrindex.name_hashes);
+    free(context->shdrindex.types);
+    memset(&context->shdrindex, 0, sizeof(context->shdrindex));
+
+    free(context->segments);
+    context->segments = NULL;
+    context->segments_by_offset = NULL;
+    context->segment_num = 0;
+    free(context->functable_block);
+    context->functable_block = NULL;
+    memset(&context->functable, 0, sizeof(context->functable));
+    free(context->dirty);
+    context->dirty = NULL;
+    context->dirty_num = 0;
+    context->dirty_max = 0;
+    for (size_t i = 0; i < context->appended_num; i++) {
+        free(context->appended[i].data);
+    }
+    memset(context->appended, 0, sizeof(context->appended));
+    context->appended_num = 0;
+    context->append_vaddr = 0;
+
+    if (context->mode == ELF_LOAD_MMAP) {
+        munmap(context->data, context->size);
+    } else {
+        free(context->data);
+    }
+
+    context->data = NULL;
+    strcpy(context->path, "");
+    context->size = 0;
+}
+
 int elf_unload_elf(void)
 {
     if (!elf_elf_loaded()) {
         return elf_stack_error(ELF_ERR_UNLOADED);
     }
 
-    free(elfpv.data);
-    elfpv.data = NULL;
-    strcpy(elfpv.path, "");
-    elfpv.size = 0;
+    elf_release_context(elfctx);
     return elf_stack_error(ELF_OK);
 }
 
+int elf_create_context(elf_context** context_ref)
+{
+    if (context_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    elf_context* context = calloc(1, sizeof(*context));
+    if (context == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    pthread_mutex_init(&context->lock, NULL);
+
+    *context_ref = context;
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_destroy_context(elf_context* context)
+{
+    if (context == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    if (context == &elf_main_context) {
+        return elf_stack_error(ELF_ERR_OPTION);
+    }
+
+    if (context == elfctx) {
+        elfctx = &elf_main_context;
+    }
+
+    if (context->data != NULL) {
+        elf_release_context(context);
+    }
+
+    pthread_mutex_destroy(&context->lock);
+    free(context);
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_bind_context(elf_context* context)
+{
+    elfctx = (context != NULL) ? context : &elf_main_context;
+    return elf_stack_error(ELF_OK);
+}
+
+elf_context* elf_current_context(void)
+{
+    return elfctx;
+}
+
 int elf_print_elf(void)
 {
     elf_newl("%s", "");
-    size_t path_len = strlen(elfpv.path);
-    elf_snewl(elfpv.path, path_len);
-    elf_unewl(elfpv.size);
+    size_t path_len = strlen(elfctx->path);
+    elf_snewl(elfctx->path, path_len);
+    elf_unewl(elfctx->size);
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_mark_dirty(size_t offset, size_t size)
+{
+    // several threads may patch the same context.
+    pthread_mutex_lock(&elfctx->lock);
+    if (elfctx->dirty_num == elfctx->dirty_max) {
+        size_t max = (elfctx->dirty_max) ? elfctx->dirty_max * 2 : 64;
+        elf_range* dirty = realloc(elfctx->dirty, max * sizeof(*dirty));
+        if (dirty == NULL) {
+            pthread_mutex_unlock(&elfctx->lock);
+            return elf_stack_error(ELF_ERR_MALLOC);
+        }
+        elfctx->dirty = dirty;
+        elfctx->dirty_max = max;
+    }
+
+    elfctx->dirty[elfctx->dirty_num++] = (elf_range) { offset, size };
+    pthread_mutex_unlock(&elfctx->lock);
+    return elf_stack_error(ELF_OK);
+}
+
+#define ELF_SAVE_GAP 4096
+
+static int elf_compare_range(const void* a, const void* b)
+{
+    const elf_range* x = a;
+    const elf_range* y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int elf_source_unchanged(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return 0;
+    }
+
+    const struct stat* old = &elfctx->source;
+    return st.st_dev == old->st_dev && st.st_ino == old->st_ino
+        && st.st_size == old->st_size
+        && st.st_mtim.tv_sec == old->st_mtim.tv_sec
+        && st.st_mtim.tv_nsec == old->st_mtim.tv_nsec;
+}
+
+static int elf_write_elf(int fd)
+{
+    // clones the source and rewrites only what was patched; the whole
+    // image is written if the source changed on disk since it was loaded.
+    int source = open(elfctx->path, O_RDONLY | O_CLOEXEC);
+    int delta = source >= 0 && elf_source_unchanged(source)
+        && elf_copy_fd(source, fd, elfctx->size) == ELF_OK;
+
+    if (source >= 0) {
+        close(source);
+    }
+
+    if (!delta) {
+        elfctx->dirty_num = 0;
+        elf_check(elf_mark_dirty(0, elfctx->size));
+        if (ftruncate(fd, 0) != 0) {
+            return elf_stack_error(ELF_ERR_WRITE);
+        }
+    }
+
+    qsort(elfctx->dirty, elfctx->dirty_num, sizeof(*elfctx->dirty), elf_compare_range);
+
+    size_t i = 0;
+    while (i < elfctx->dirty_num) {
+        size_t start = elfctx->dirty[i].offset;
+        size_t end = start + elfctx->dirty[i].size;
+        // close ranges are written together, the bytes between them are unchanged.
+        for (i++; i < elfctx->dirty_num && elfctx->dirty[i].offset <= end + ELF_SAVE_GAP; i++) {
+            size_t next_end = elfctx->dirty[i].offset + elfctx->dirty[i].size;
+            end = (next_end > end) ? next_end : end;
+        }
+
+        for (size_t done = start; done < end;) {
+            ssize_t result = pwrite(fd, elfctx->data + done, end - done, done);
+            if (result <= 0) {
+                return elf_stack_error(ELF_ERR_WRITE);
+            }
+            done += result;
+        }
+    }
+
+    // appended segments extend the file, the gaps before them read as zeros.
+    for (size_t a = 0; a < elfctx->appended_num; a++) {
+        const elf_appended* appended = &elfctx->appended[a];
+        for (size_t done = 0; done < appended->size;) {
+            ssize_t result = pwrite(fd, appended->data + done, appended->size - done, appended->offset + done);
+            if (result <= 0) {
+                return elf_stack_error(ELF_ERR_WRITE);
+            }
+            done += result;
+        }
+    }
+
     return elf_stack_error(ELF_OK);
 }
 
 int elf_save_elf(const char* path)
 {
-    FILE* file = fopen("out", "wb");
-    if (file == NULL) {
+    if (!elf_elf_loaded()) {
+        return elf_stack_error(ELF_ERR_UNLOADED);
+    }
+
+    if (path == NULL) {
         return elf_stack_error(ELF_ERR_NULL);
     }
 
-    fwrite(elfpv.data, 1, elfpv.size, file);
-    fclose(file);
+    // written next to the destination, then renamed over it.
+    char temp[PATH_MAX];
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp)) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    int fd = mkstemp(temp);
+    if (fd < 0) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    int error = elf_write_elf(fd);
+    if (error == ELF_OK && fchmod(fd, elfctx->source.st_mode & 07777) != 0) {
+        error = ELF_ERR_WRITE;
+    }
+    if (close(fd) != 0 && error == ELF_OK) {
+        error = ELF_ERR_WRITE;
+    }
+    if (error == ELF_OK && rename(temp, path) != 0) {
+        error = ELF_ERR_WRITE;
+    }
+
+    if (error != ELF_OK) {
+        unlink(temp);
+        return elf_stack_error(error);
+    }
+
     return elf_stack_error(ELF_OK);
 }
 
@@ -158,12 +521,12 @@ int elf_offset(size_t offset, size_t ref_size, void** ref_ref)
         return elf_stack_error(ELF_ERR_UNLOADED);
     }
 
-    if (offset + ref_size > elfpv.size) {
-        printf("%zu + %zu > %zu\n", offset, ref_size, elfpv.size);
+    if (offset + ref_size > elfctx->size) {
+        printf("%zu + %zu > %zu\n", offset, ref_size, elfctx->size);
         return elf_stack_error(ELF_ERR_SEGFAULT);
     }
 
-    *ref_ref = elfpv.data + offset;
+    *ref_ref = elfctx->data + offset;
     return elf_stack_error(ELF_OK);
 }
 
@@ -173,8 +536,8 @@ int elf_get_offset(const void* end, const void* start, size_t* offset_ref)
         return elf_stack_error(ELF_ERR_UNLOADED);
     }
 
-    void* absolute_end = elfpv.data + elfpv.size;
-    void* absolute_start = elfpv.data;
+    void* absolute_end = elfctx->data + elfctx->size;
+    void* absolute_start = elfctx->data;
 
     if (end > absolute_end || end < absolute_start) {
         return elf_stack_error(ELF_ERR_SEGFAULT);
@@ -278,15 +641,414 @@ int elf_print_phdr(Elf64_Phdr* phdr)
     return elf_stack_error(ELF_OK);
 }
 
-int elf_get_shdr_strtab_shdr(Elf64_Shdr** shdr_ref)
+static int elf_compare_segment_vaddr(const void* a, const void* b)
+{
+    const elf_segment* x = a;
+    const elf_segment* y = b;
+    return (x->vaddr > y->vaddr) - (x->vaddr < y->vaddr);
+}
+
+static int elf_compare_segment_offset(const void* a, const void* b)
+{
+    const elf_segment* x = a;
+    const elf_segment* y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+int elf_build_segment_table(void)
 {
+    if (elfctx->segments != NULL) {
+        return elf_stack_error(ELF_OK);
+    }
+
     Elf64_Ehdr* hdr;
     elf_check(elf_get_hdr(&hdr));
 
-    Elf64_Shdr* shtext_sh;
-    elf_check(elf_get_shdr_windex(hdr->e_shstrndx, &shtext_sh));
+    // the same table sorted twice, one per direction of translation.
+    elf_segment* segments = malloc(2 * (hdr->e_phnum + 1) * sizeof(*segments));
+    if (segments == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    size_t num = 0;
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        int error = elf_get_phdr_windex(i, &phdr);
+        if (error != ELF_OK) {
+            free(segments);
+            return elf_stack_error(error);
+        }
+
+        if (phdr->p_type == PT_LOAD && phdr->p_filesz > 0) {
+            segments[num++] = (elf_segment) { phdr->p_vaddr, phdr->p_offset, phdr->p_filesz };
+        }
+    }
+
+    elf_segment* by_offset = segments + hdr->e_phnum + 1;
+    memcpy(by_offset, segments, num * sizeof(*segments));
+    qsort(segments, num, sizeof(*segments), elf_compare_segment_vaddr);
+    qsort(by_offset, num, sizeof(*segments), elf_compare_segment_offset);
+
+    elfctx->segments = segments;
+    elfctx->segments_by_offset = by_offset;
+    elfctx->segment_num = num;
+    return elf_stack_error(ELF_OK);
+}
+
+static elf_segment* elf_find_segment(elf_segment* segments, size_t num, uint64_t key, int by_offset)
+{
+    // last segment starting at or before key.
+    size_t low = 0;
+    size_t high = num;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        uint64_t start = (by_offset) ? segments[mid].offset : segments[mid].vaddr;
+        if (start <= key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return (low > 0) ? &segments[low - 1] : NULL;
+}
+
+int elf_vaddr_to_offset(Elf64_Addr vaddr, size_t* offset_ref)
+{
+    elf_check(elf_build_segment_table());
+
+    elf_segment* segment = elf_find_segment(elfctx->segments, elfctx->segment_num, vaddr, 0);
+    if (segment == NULL || vaddr - segment->vaddr >= segment->filesz) {
+        return elf_stack_error(ELF_ERR_OFFSET);
+    }
+
+    *offset_ref = vaddr - segment->vaddr + segment->offset;
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_offset_to_vaddr(size_t offset, Elf64_Addr* vaddr_ref)
+{
+    elf_check(elf_build_segment_table());
+
+    elf_segment* segment = elf_find_segment(elfctx->segments_by_offset, elfctx->segment_num, offset, 1);
+    if (segment == NULL || offset - segment->offset >= segment->filesz) {
+        return elf_stack_error(ELF_ERR_OFFSET);
+    }
+
+    *vaddr_ref = offset - segment->offset + segment->vaddr;
+    return elf_stack_error(ELF_OK);
+}
+
+static size_t elf_align_up(size_t value, size_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+static int elf_take_spare_phdr(Elf64_Ehdr* hdr, size_t* index_ref)
+{
+    // PT_NULL entries are free, a PT_NOTE only describes notes that the
+    // loader ignores; the last one is taken so that earlier notes stay visible.
+    size_t null_index = hdr->e_phnum;
+    size_t note_index = hdr->e_phnum;
+    size_t last_load = 0;
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        elf_check(elf_get_phdr_windex(i, &phdr));
+
+        if (phdr->p_type == PT_LOAD) {
+            last_load = i;
+        } else if (phdr->p_type == PT_NULL && null_index == hdr->e_phnum) {
+            null_index = i;
+        } else if (phdr->p_type == PT_NOTE) {
+            note_index = i;
+        }
+    }
+
+    size_t spare = (null_index != hdr->e_phnum) ? null_index : note_index;
+    if (spare == hdr->e_phnum) {
+        puts("No spare program header for the appended segment.");
+        return elf_stack_error(ELF_ERR_NOT_FOUND);
+    }
+
+    // loaders want PT_LOAD entries sorted by address, the new one goes last.
+    Elf64_Phdr* table;
+    elf_check(elf_get_phdr_windex(0, &table));
+    if (spare < last_load) {
+        Elf64_Phdr taken = table[spare];
+        memmove(&table[spare], &table[spare + 1], (last_load - spare) * sizeof(*table));
+        table[last_load] = taken;
+        spare = last_load;
+    }
+
+    *index_ref = spare;
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_append_segment(size_t size, Elf64_Word flags, Elf64_Addr* vaddr_ref, elf_bytebuffer* buf_ref)
+{
+    if (vaddr_ref == NULL || buf_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    Elf64_Ehdr* hdr;
+    elf_check(elf_get_hdr(&hdr));
+    if (hdr->e_type != ET_EXEC && hdr->e_type != ET_DYN) {
+        return elf_stack_error(ELF_ERR_TYPE);
+    }
+    if (hdr->e_phentsize != sizeof(Elf64_Phdr) || elfctx->appended_num == ELF_APPENDED_MAX) {
+        return elf_stack_error(ELF_ERR_NOT_IMPL);
+    }
+
+    size_t align = sysconf(_SC_PAGESIZE);
+    Elf64_Addr end = elfctx->append_vaddr;
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        elf_check(elf_get_phdr_windex(i, &phdr));
+        if (phdr->p_type == PT_LOAD) {
+            end = (phdr->p_vaddr + phdr->p_memsz > end) ? phdr->p_vaddr + phdr->p_memsz : end;
+            align = (phdr->p_align > align) ? phdr->p_align : align;
+        }
+    }
+
+    size_t file_end = elfctx->size;
+    if (elfctx->appended_num > 0) {
+        const elf_appended* last = &elfctx->appended[elfctx->appended_num - 1];
+        file_end = last->offset + last->size;
+    }
+
+    uint8_t* data = calloc(1, size);
+    if (data == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
 
-    *shdr_ref = shtext_sh;
+    size_t index;
+    int error = elf_take_spare_phdr(hdr, &index);
+    if (error != ELF_OK) {
+        free(data);
+        return elf_stack_error(error);
+    }
+
+    // offset and address only need to agree modulo the alignment.
+    size_t offset = elf_align_up(file_end, sysconf(_SC_PAGESIZE));
+    Elf64_Addr vaddr = elf_align_up(end, align) + offset % align;
+
+    Elf64_Phdr* phdr;
+    elf_check(elf_get_phdr_windex(index, &phdr));
+    *phdr = (Elf64_Phdr) {
+        .p_type = PT_LOAD,
+        .p_flags = flags,
+        .p_offset = offset,
+        .p_vaddr = vaddr,
+        .p_paddr = vaddr,
+        .p_filesz = size,
+        .p_memsz = size,
+        .p_align = align,
+    };
+    elf_check(elf_mark_dirty(hdr->e_phoff, hdr->e_phnum * sizeof(Elf64_Phdr)));
+
+    elfctx->appended[elfctx->appended_num++] = (elf_appended) { offset, size, data };
+
+    // rebuilt on next use, with the new segment.
+    free(elfctx->segments);
+    elfctx->segments = NULL;
+    elfctx->segments_by_offset = NULL;
+    elfctx->segment_num = 0;
+
+    *vaddr_ref = vaddr;
+    *buf_ref = data;
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_extend_bss(size_t size, size_t align, Elf64_Addr* vaddr_ref)
+{
+    if (vaddr_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    Elf64_Ehdr* hdr;
+    elf_check(elf_get_hdr(&hdr));
+    if (hdr->e_type != ET_EXEC && hdr->e_type != ET_DYN) {
+        return elf_stack_error(ELF_ERR_TYPE);
+    }
+
+    // zeroed memory costs no file bytes and no program header at the end of
+    // the last writable segment.
+    Elf64_Phdr* last = NULL;
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        elf_check(elf_get_phdr_windex(i, &phdr));
+        if (phdr->p_type == PT_LOAD && (last == NULL || phdr->p_vaddr > last->p_vaddr)) {
+            last = phdr;
+        }
+    }
+
+    if (last == NULL || !(last->p_flags & PF_W)) {
+        puts("The last loadable segment is not writable.");
+        return elf_stack_error(ELF_ERR_NOT_IMPL);
+    }
+
+    Elf64_Addr end = last->p_vaddr + last->p_memsz;
+    Elf64_Addr vaddr = elf_align_up((end > elfctx->append_vaddr) ? end : elfctx->append_vaddr, align);
+    last->p_memsz = vaddr + size - last->p_vaddr;
+    elf_check(elf_mark_dirty(hdr->e_phoff, hdr->e_phnum * sizeof(Elf64_Phdr)));
+
+    *vaddr_ref = vaddr;
+    return elf_stack_error(ELF_OK);
+}
+
+// moves the grown bss and the appended segments to vaddr or after, e.g. past
+// the heap of a running executable. set before any of them is added.
+int elf_set_append_vaddr(Elf64_Addr vaddr)
+{
+    if (!elf_elf_loaded()) {
+        return elf_stack_error(ELF_ERR_UNLOADED);
+    }
+    if (elfctx->appended_num > 0) {
+        return elf_stack_error(ELF_ERR_NOT_IMPL);
+    }
+
+    elfctx->append_vaddr = vaddr;
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_phdr_prot(Elf64_Word flags)
+{
+    return ((flags & PF_R) ? PROT_READ : 0) | ((flags & PF_W) ? PROT_WRITE : 0) | ((flags & PF_X) ? PROT_EXEC : 0);
+}
+
+static const Elf64_Phdr* elf_range_phdr(Elf64_Ehdr* hdr, const elf_range* range)
+{
+    // program headers are not reloaded, only bytes of loaded segments are copied.
+    size_t phdr_end = hdr->e_phoff + hdr->e_phnum * sizeof(Elf64_Phdr);
+    if (range->offset < phdr_end && range->offset + range->size > hdr->e_phoff) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        if (elf_get_phdr_windex(i, &phdr) == ELF_OK && phdr->p_type == PT_LOAD && phdr->p_offset < elfctx->size
+            && range->offset >= phdr->p_offset && range->offset + range->size <= phdr->p_offset + phdr->p_filesz) {
+            return phdr;
+        }
+    }
+    return NULL;
+}
+
+static int elf_apply_segment(uintptr_t base, const Elf64_Phdr* phdr, size_t first, size_t last)
+{
+    // ranges are sorted; the pages spanning them are made writable once.
+    uintptr_t start = base + phdr->p_vaddr + (elfctx->dirty[first].offset - phdr->p_offset);
+    uintptr_t end = start;
+    for (size_t i = first; i < last; i++) {
+        uintptr_t range_end = base + phdr->p_vaddr + (elfctx->dirty[i].offset + elfctx->dirty[i].size - phdr->p_offset);
+        end = (range_end > end) ? range_end : end;
+    }
+
+    // writable pages may be read-only after relocation, they are left as they are;
+    // code pages stay executable, the code patching them may run from them.
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t page_start = start & ~(page - 1);
+    size_t length = elf_align_up(end, page) - page_start;
+    int prot = elf_phdr_prot(phdr->p_flags);
+    if (!(prot & PROT_WRITE) && mprotect((void*)page_start, length, prot | PROT_WRITE) != 0) {
+        return elf_stack_error(ELF_ERR_WRITE);
+    }
+
+    for (size_t i = first; i < last; i++) {
+        const elf_range* range = &elfctx->dirty[i];
+        memcpy((void*)(base + phdr->p_vaddr + (range->offset - phdr->p_offset)), elfctx->data + range->offset, range->size);
+    }
+
+    if (!(prot & PROT_WRITE) && mprotect((void*)page_start, length, prot) != 0) {
+        return elf_stack_error(ELF_ERR_WRITE);
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_apply_elf(uintptr_t base, Elf64_Addr mapped_end)
+{
+    if (!elf_elf_loaded()) {
+        return elf_stack_error(ELF_ERR_UNLOADED);
+    }
+
+    Elf64_Ehdr* hdr;
+    elf_check(elf_get_hdr(&hdr));
+    if (hdr->e_type != ET_EXEC && hdr->e_type != ET_DYN) {
+        return elf_stack_error(ELF_ERR_TYPE);
+    }
+
+    // the grown bss and the appended segments lie past the mapped image, from
+    // the address set by elf_set_append_vaddr if it is further.
+    size_t page = sysconf(_SC_PAGESIZE);
+    Elf64_Addr start = (elfctx->append_vaddr > mapped_end) ? elfctx->append_vaddr : mapped_end;
+    Elf64_Addr end = start;
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        elf_check(elf_get_phdr_windex(i, &phdr));
+        if (phdr->p_type == PT_LOAD && phdr->p_vaddr + phdr->p_memsz > end) {
+            end = phdr->p_vaddr + phdr->p_memsz;
+        }
+    }
+
+    uintptr_t area_start = base + elf_align_up(start, page);
+    uintptr_t area_end = base + elf_align_up(end, page);
+    if (area_end > area_start) {
+        void* area = mmap((void*)area_start, area_end - area_start, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (area != MAP_FAILED && area != (void*)area_start) {
+            munmap(area, area_end - area_start);
+            area = MAP_FAILED;
+        }
+        if (area == MAP_FAILED) {
+            puts("The memory for the slots and stubs is already in use.");
+            return elf_stack_error(ELF_ERR_MALLOC);
+        }
+    }
+
+    // stubs are in place before any patched function can jump to them.
+    for (size_t a = 0; a < elfctx->appended_num; a++) {
+        const elf_appended* appended = &elfctx->appended[a];
+        for (size_t i = 0; i < hdr->e_phnum; i++) {
+            Elf64_Phdr* phdr;
+            elf_check(elf_get_phdr_windex(i, &phdr));
+            if (phdr->p_type != PT_LOAD || phdr->p_offset != appended->offset) {
+                continue;
+            }
+
+            void* address = (void*)(base + phdr->p_vaddr);
+            memcpy(address, appended->data, appended->size);
+            if (mprotect(address, elf_align_up(appended->size, page), elf_phdr_prot(phdr->p_flags)) != 0) {
+                return elf_stack_error(ELF_ERR_WRITE);
+            }
+        }
+    }
+
+    // consecutive ranges of the same segment are copied together.
+    qsort(elfctx->dirty, elfctx->dirty_num, sizeof(*elfctx->dirty), elf_compare_range);
+    size_t r = 0;
+    while (r < elfctx->dirty_num) {
+        const Elf64_Phdr* phdr = elf_range_phdr(hdr, &elfctx->dirty[r]);
+        size_t first = r++;
+        while (phdr != NULL && r < elfctx->dirty_num && elf_range_phdr(hdr, &elfctx->dirty[r]) == phdr) {
+            r++;
+        }
+        if (phdr != NULL) {
+            elf_check(elf_apply_segment(base, phdr, first, r));
+        }
+    }
+
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_get_shdr_strtab_shdr(Elf64_Shdr** shdr_ref)
+{
+    elf_check(elf_build_shdr_index());
+
+    if (elfctx->shdrindex.shstrtab_sh == NULL) {
+        return elf_stack_error(ELF_ERR_NOT_FOUND);
+    }
+
+    *shdr_ref = elfctx->shdrindex.shstrtab_sh;
     return elf_stack_error(ELF_OK);
 }
 
@@ -304,22 +1066,113 @@ int elf_get_shdr_windex(size_t index, Elf64_Shdr** shdr_ref)
     return elf_stack_error(ELF_OK);
 }
 
-int elf_get_shdr_wname(const char* name, Elf64_Shdr** shdr_ref)
+static uint32_t elf_hash_type(Elf64_Word type)
+{
+    return type * 2654435761u;
+}
+
+int elf_build_shdr_index(void)
 {
+    elf_shdr_index* index = &elfctx->shdrindex;
+    if (index->names != NULL) {
+        return elf_stack_error(ELF_OK);
+    }
+
     Elf64_Ehdr* hdr;
     elf_check(elf_get_hdr(&hdr));
 
-    Elf64_Shdr* shtext_sh;
-    elf_check(elf_get_shdr_strtab_shdr(&shtext_sh));
+    Elf64_Shdr* shstrtab_sh = NULL;
+    void* shstrtab = NULL;
+    if (hdr->e_shstrndx != SHN_UNDEF) {
+        elf_check(elf_get_shdr_windex(hdr->e_shstrndx, &shstrtab_sh));
+        elf_check(elf_strtab_shdr_type(shstrtab_sh));
+        elf_check(elf_offset(shstrtab_sh->sh_offset, shstrtab_sh->sh_size, &shstrtab));
+    }
+
+    size_t capacity = 16;
+    while (capacity < (size_t)hdr->e_shnum * 2) {
+        capacity <<= 1;
+    }
+
+    uint32_t* names = calloc(capacity, sizeof(*names));
+    uint32_t* name_hashes = malloc(capacity * sizeof(*name_hashes));
+    uint32_t* types = calloc(capacity, sizeof(*types));
+    if (names == NULL || name_hashes == NULL || types == NULL) {
+        free(names);
+        free(name_hashes);
+        free(types);
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    Elf64_Shdr* first_sh = NULL;
+    if (hdr->e_shnum > 0) {
+        size_t table_size = (size_t)hdr->e_shentsize * hdr->e_shnum;
+        if (hdr->e_shentsize < sizeof(Elf64_Shdr) || elf_offset(hdr->e_shoff, table_size, (void**)&first_sh) != ELF_OK) {
+            free(names);
+            free(name_hashes);
+            free(types);
+            return elf_stack_error(ELF_ERR_ELF);
+        }
+    }
 
+    index->shstrtab_sh = shstrtab_sh;
+    index->shstrtab = shstrtab;
+    index->names = names;
+    index->name_hashes = name_hashes;
+    index->types = types;
+    index->mask = capacity - 1;
+
+    // both tables keep the first section of a given name or type,
+    // like the linear scans they replace.
     for (size_t i = 0; i < hdr->e_shnum; i++) {
-        Elf64_Shdr* sh;
-        elf_check(elf_get_shdr_windex(i, &sh));
+        Elf64_Shdr* sh = (Elf64_Shdr*)((uint8_t*)first_sh + i * hdr->e_shentsize);
+
+        size_t j = elf_hash_type(sh->sh_type) & index->mask;
+        while (types[j] != 0 && ((Elf64_Shdr*)((uint8_t*)first_sh + (types[j] - 1) * hdr->e_shentsize))->sh_type != sh->sh_type) {
+            j = (j + 1) & index->mask;
+        }
+        if (types[j] == 0) {
+            types[j] = i + 1;
+        }
+
+        if (shstrtab == NULL || sh->sh_name >= shstrtab_sh->sh_size) {
+            continue;
+        }
+
+        const char* name = index->shstrtab + sh->sh_name;
+        if (memchr(name, '\0', shstrtab_sh->sh_size - sh->sh_name) == NULL) {
+            continue;
+        }
+
+        uint32_t hash = elf_hash_name(name);
+        j = hash & index->mask;
+        while (names[j] != 0) {
+            Elf64_Shdr* other = (Elf64_Shdr*)((uint8_t*)first_sh + (names[j] - 1) * hdr->e_shentsize);
+            if (name_hashes[j] == hash && strcmp(index->shstrtab + other->sh_name, name) == 0) {
+                break;
+            }
+            j = (j + 1) & index->mask;
+        }
+        if (names[j] == 0) {
+            names[j] = i + 1;
+            name_hashes[j] = hash;
+        }
+    }
 
-        const char* sh_text;
-        elf_check(elf_get_strtab_shdr_text(shtext_sh, sh->sh_name, &sh_text));
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_get_shdr_wname(const char* name, Elf64_Shdr** shdr_ref)
+{
+    elf_check(elf_build_shdr_index());
+
+    elf_shdr_index* index = &elfctx->shdrindex;
+    uint32_t hash = elf_hash_name(name);
+    for (size_t j = hash & index->mask; index->names[j] != 0; j = (j + 1) & index->mask) {
+        Elf64_Shdr* sh;
+        elf_check(elf_get_shdr_windex(index->names[j] - 1, &sh));
 
-        if (strcmp(name, sh_text) == 0) {
+        if (index->name_hashes[j] == hash && strcmp(index->shstrtab + sh->sh_name, name) == 0) {
             *shdr_ref = sh;
             return elf_stack_error(ELF_OK);
         }
@@ -330,12 +1183,12 @@ int elf_get_shdr_wname(const char* name, Elf64_Shdr** shdr_ref)
 
 int elf_get_shdr_wtype(Elf64_Word type, Elf64_Shdr** shdr_ref)
 {
-    Elf64_Ehdr* hdr;
-    elf_check(elf_get_hdr(&hdr));
+    elf_check(elf_build_shdr_index());
 
-    for (size_t i = 0; i < hdr->e_shnum; i++) {
+    elf_shdr_index* index = &elfctx->shdrindex;
+    for (size_t j = elf_hash_type(type) & index->mask; index->types[j] != 0; j = (j + 1) & index->mask) {
         Elf64_Shdr* sh;
-        elf_check(elf_get_shdr_windex(i, &sh));
+        elf_check(elf_get_shdr_windex(index->types[j] - 1, &sh));
 
         if (sh->sh_type == type) {
             *shdr_ref = sh;
@@ -468,9 +1321,18 @@ int elf_get_sym_windex(Elf64_Shdr* sym_sh, size_t index, Elf64_Sym** sym_ref)
     return elf_stack_error(ELF_OK);
 }
 
-int elf_get_sym_wname(Elf64_Shdr* sym_sh, const char* name, Elf64_Sym** sym_ref)
+static const char* elf_sym_index_name(elf_sym_index* index, uint32_t slot)
 {
-    elf_check(elf_sym_shdr_type(sym_sh));
+    const Elf64_Sym* sym = (const Elf64_Sym*)(index->symbols + (slot - 1) * index->entsize);
+    return index->strtab + sym->st_name;
+}
+
+int elf_build_sym_index(Elf64_Shdr* sym_sh)
+{
+    elf_sym_index* index = &elfctx->symindex;
+    if (index->sym_sh == sym_sh && index->slots != NULL) {
+        return elf_stack_error(ELF_OK);
+    }
 
     Elf64_Shdr* strtab_sh;
     elf_check(elf_get_sym_strtab_shdr(sym_sh, &strtab_sh));
@@ -478,16 +1340,79 @@ int elf_get_sym_wname(Elf64_Shdr* sym_sh, const char* name, Elf64_Sym** sym_ref)
     size_t sym_num;
     elf_check(elf_get_sym_num(sym_sh, &sym_num));
 
+    if (sym_sh->sh_entsize < sizeof(Elf64_Sym) || sym_num >= UINT32_MAX / 2) {
+        return elf_stack_error(ELF_ERR_INVALID_SIZE);
+    }
+
+    void* symbols;
+    void* strtab;
+    elf_check(elf_offset(sym_sh->sh_offset, sym_num * sym_sh->sh_entsize, &symbols));
+    elf_check(elf_offset(strtab_sh->sh_offset, strtab_sh->sh_size, &strtab));
+
+    size_t capacity = 16;
+    while (capacity < sym_num * 2) {
+        capacity <<= 1;
+    }
+
+    uint32_t* slots = calloc(capacity, sizeof(*slots));
+    uint32_t* hashes = malloc(capacity * sizeof(*hashes));
+    if (slots == NULL || hashes == NULL) {
+        free(slots);
+        free(hashes);
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    free(index->slots);
+    free(index->hashes);
+    index->sym_sh = sym_sh;
+    index->symbols = symbols;
+    index->entsize = sym_sh->sh_entsize;
+    index->strtab = strtab;
+    index->slots = slots;
+    index->hashes = hashes;
+    index->mask = capacity - 1;
+
+    // symbols are inserted in table order and duplicates are dropped,
+    // so a lookup returns the same symbol as a linear scan would.
     for (size_t i = 0; i < sym_num; i++) {
-        size_t offset = sym_sh->sh_offset + i * sym_sh->sh_entsize;
-        Elf64_Sym* sym;
-        elf_check(elf_offset(offset, sym_sh->sh_entsize, (void**)&sym));
+        const Elf64_Sym* sym = (const Elf64_Sym*)(index->symbols + i * index->entsize);
+        if (sym->st_name >= strtab_sh->sh_size) {
+            continue;
+        }
+
+        const char* name = index->strtab + sym->st_name;
+        if (memchr(name, '\0', strtab_sh->sh_size - sym->st_name) == NULL) {
+            continue;
+        }
 
-        const char* sym_name;
-        elf_check(elf_get_strtab_shdr_text(strtab_sh, sym->st_name, &sym_name));
+        uint32_t hash = elf_hash_name(name);
+        size_t j = hash & index->mask;
+        while (slots[j] != 0) {
+            if (hashes[j] == hash && strcmp(elf_sym_index_name(index, slots[j]), name) == 0) {
+                break;
+            }
+            j = (j + 1) & index->mask;
+        }
+
+        if (slots[j] == 0) {
+            slots[j] = i + 1;
+            hashes[j] = hash;
+        }
+    }
 
-        if (strcmp(sym_name, name) == 0) {
-            *sym_ref = sym;
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_get_sym_wname(Elf64_Shdr* sym_sh, const char* name, Elf64_Sym** sym_ref)
+{
+    elf_check(elf_build_sym_index(sym_sh));
+
+    elf_sym_index* index = &elfctx->symindex;
+    uint32_t hash = elf_hash_name(name);
+    for (size_t j = hash & index->mask; index->slots[j] != 0; j = (j + 1) & index->mask) {
+        uint32_t slot = index->slots[j];
+        if (index->hashes[j] == hash && strcmp(elf_sym_index_name(index, slot), name) == 0) {
+            *sym_ref = (Elf64_Sym*)(index->symbols + (slot - 1) * index->entsize);
             return elf_stack_error(ELF_OK);
         }
     }
@@ -528,9 +1453,8 @@ int elf_get_sym_wtype(Elf64_Shdr* sym_sh, uint16_t type, elf_index_iterator* ite
 
 int elf_get_sym_offset(Elf64_Sym* sym, size_t* offset_ref)
 {
-    int result0 = elf_sym_type(sym, STT_FUNC);
-    int result1 = elf_sym_type(sym, STT_OBJECT);
-    if (result0 != ELF_OK && result1 != ELF_OK) {
+    int type = ELF64_ST_TYPE(sym->st_info);
+    if (type != STT_FUNC && type != STT_OBJECT) {
         return elf_stack_error(ELF_ERR_TYPE);
     }
 
@@ -553,9 +1477,7 @@ int elf_get_sym_offset(Elf64_Sym* sym, size_t* offset_ref)
     size_t offset;
 
     if (hdr->e_type == ET_EXEC || hdr->e_type == ET_DYN) {
-        Elf64_Phdr* phdr;
-        elf_check(elf_get_phdr_wtype(PT_LOAD, &phdr));
-        offset = sym->st_value - phdr->p_vaddr + phdr->p_offset;
+        elf_check(elf_vaddr_to_offset(sym->st_value, &offset));
     }
 
     if (hdr->e_type == ET_REL) {
@@ -585,19 +1507,264 @@ int elf_get_readonly_sym_bytes(Elf64_Sym* sym, elf_ro_bytebuff* buf_ref, size_t*
     return elf_stack_error(ELF_OK);
 }
 
+int elf_set_file_bytes(size_t offset, elf_bytebuffer buf, size_t size)
+{
+    void* bytes;
+    elf_check(elf_offset(offset, size, &bytes));
+    elf_check(elf_mark_dirty(offset, size));
+    memcpy(bytes, buf, size);
+    return elf_stack_error(ELF_OK);
+}
+
 int elf_set_sym_bytes(Elf64_Sym* sym, size_t offset, elf_bytebuffer buf, size_t size)
 {
     size_t buf_len;
     elf_bytebuffer sym_buf;
     elf_check(elf_get_writable_sym_bytes(sym, &sym_buf, &buf_len));
 
-    void* addr;
-    elf_check(elf_offset(offset, size, &addr));
+    if (offset > buf_len || size > buf_len - offset) {
+        return elf_stack_error(ELF_ERR_SEGFAULT);
+    }
+
+    size_t file_offset;
+    elf_check(elf_get_offset(sym_buf + offset, elfctx->data, &file_offset));
+    elf_check(elf_mark_dirty(file_offset, size));
 
     memcpy(sym_buf + offset, buf, size);
     return elf_stack_error(ELF_OK);
 }
 
+static size_t elf_count_byte_scalar(const uint8_t* text, size_t size, uint8_t byte)
+{
+    size_t i = 0;
+    while (i < size && text[i] == byte) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2"))) static size_t elf_count_byte_avx2(const uint8_t* text, size_t size, uint8_t byte)
+{
+    const __m256i pattern = _mm256_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(text + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern));
+        if (mask != 0xffffffffu) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i + elf_count_byte_scalar(text + i, size - i, byte);
+}
+
+static size_t elf_count_byte_sse2(const uint8_t* text, size_t size, uint8_t byte)
+{
+    const __m128i pattern = _mm_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(text + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern));
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i + elf_count_byte_scalar(text + i, size - i, byte);
+}
+#endif
+
+// length of the run of byte at the start of text, never reads past size.
+static size_t elf_count_byte(const uint8_t* text, size_t size, uint8_t byte)
+{
+#ifdef __x86_64__
+    // patch and batch workers may pick it at the same time, they pick the same one.
+    static size_t (*chosen)(const uint8_t*, size_t, uint8_t) = NULL;
+    size_t (*count)(const uint8_t*, size_t, uint8_t) = __atomic_load_n(&chosen, __ATOMIC_RELAXED);
+    if (count == NULL) {
+        count = __builtin_cpu_supports("avx2") ? elf_count_byte_avx2 : elf_count_byte_sse2;
+        __atomic_store_n(&chosen, count, __ATOMIC_RELAXED);
+    }
+    return count(text, size, byte);
+#else
+    return elf_count_byte_scalar(text, size, byte);
+#endif
+}
+
+int elf_scan_func_prologue(elf_ro_bytebuff text, size_t size, uint8_t* endbr64_ref, uint32_t* padding_ref)
+{
+    static const uint8_t endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+    static const uint8_t nop = 0x90;
+
+    if (text == NULL || endbr64_ref == NULL || padding_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    size_t start = (size >= sizeof(endbr64) && memcmp(text, endbr64, sizeof(endbr64)) == 0) ? sizeof(endbr64) : 0;
+
+    *endbr64_ref = start;
+    *padding_ref = elf_count_byte(text + start, size - start, nop);
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_compare_addr(const void* a, const void* b)
+{
+    Elf64_Addr x = *(const Elf64_Addr*)a;
+    Elf64_Addr y = *(const Elf64_Addr*)b;
+    return (x > y) - (x < y);
+}
+
+#define ELF_PREFIX_MAX 255
+
+static int elf_scan_func_prefixes(elf_func_table* table)
+{
+    // -fpatchable-function-entry=N,M puts M nops before the symbol; the first
+    // nop of every site is listed in __patchable_function_entries.
+    Elf64_Ehdr* hdr;
+    Elf64_Shdr* entries_sh;
+    elf_check(elf_get_hdr(&hdr));
+    if (hdr->e_type == ET_REL || elf_get_shdr_wname("__patchable_function_entries", &entries_sh) != ELF_OK) {
+        return elf_stack_error(ELF_OK);
+    }
+
+    size_t num = entries_sh->sh_size / sizeof(Elf64_Addr);
+    Elf64_Addr* sites;
+    elf_check(elf_offset(entries_sh->sh_offset, num * sizeof(Elf64_Addr), (void**)&sites));
+
+    Elf64_Addr* sorted = malloc((num + 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+    memcpy(sorted, sites, num * sizeof(*sorted));
+    qsort(sorted, num, sizeof(*sorted), elf_compare_addr);
+
+    for (size_t i = 0; i < table->length; i++) {
+        Elf64_Addr start = table->symbol[i]->st_value;
+        if (table->size[i] == 0) {
+            continue;
+        }
+
+        // last site at or before the symbol.
+        size_t low = 0;
+        size_t high = num;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (sorted[mid] <= start) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        size_t prefix = (low > 0) ? start - sorted[low - 1] : 0;
+        uint8_t* text;
+        if (prefix == 0 || prefix > ELF_PREFIX_MAX || table->offset[i] < prefix
+            || elf_offset(table->offset[i] - prefix, prefix, (void**)&text) != ELF_OK) {
+            continue;
+        }
+
+        // a site of another function ends in code, not in nops.
+        if (elf_count_byte(text, prefix, 0x90) == prefix) {
+            table->prefix[i] = prefix;
+        }
+    }
+
+    free(sorted);
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_build_func_table(void)
+{
+    Elf64_Shdr* sym_sh;
+    elf_check(elf_get_sym_shdr(&sym_sh));
+
+    Elf64_Shdr* strtab_sh;
+    elf_check(elf_get_sym_strtab_shdr(sym_sh, &strtab_sh));
+
+    size_t sym_num;
+    elf_check(elf_get_sym_num(sym_sh, &sym_num));
+
+    uint8_t* symbols;
+    const char* strtab;
+    elf_check(elf_offset(sym_sh->sh_offset, sym_num * sym_sh->sh_entsize, (void**)&symbols));
+    elf_check(elf_offset(strtab_sh->sh_offset, strtab_sh->sh_size, (void**)&strtab));
+
+    size_t length = 0;
+    for (size_t i = 0; i < sym_num; i++) {
+        Elf64_Sym* sym = (Elf64_Sym*)(symbols + i * sym_sh->sh_entsize);
+        length += (ELF64_ST_TYPE(sym->st_info) == STT_FUNC);
+    }
+
+    // one block for every column of the table.
+    size_t entry_size = sizeof(Elf64_Sym*) + 2 * sizeof(size_t) + sizeof(const char*) + 2 * sizeof(uint32_t) + sizeof(uint8_t);
+    uint8_t* block = malloc(length * entry_size + 1);
+    if (block == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    elf_func_table* table = &elfctx->functable;
+    table->length = length;
+    table->symbol = (Elf64_Sym**)block;
+    table->offset = (size_t*)(table->symbol + length);
+    table->size = table->offset + length;
+    table->name = (const char**)(table->size + length);
+    table->padding = (uint32_t*)(table->name + length);
+    table->prefix = table->padding + length;
+    table->endbr64 = (uint8_t*)(table->prefix + length);
+    elfctx->functable_block = block;
+
+    size_t j = 0;
+    for (size_t i = 0; i < sym_num; i++) {
+        Elf64_Sym* sym = (Elf64_Sym*)(symbols + i * sym_sh->sh_entsize);
+        if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC) {
+            continue;
+        }
+
+        table->symbol[j] = sym;
+        table->name[j] = "";
+        if (sym->st_name < strtab_sh->sh_size && memchr(strtab + sym->st_name, '\0', strtab_sh->sh_size - sym->st_name)) {
+            table->name[j] = strtab + sym->st_name;
+        }
+
+        // undefined or unmapped functions have no bytes in the file.
+        size_t offset = 0;
+        void* text = NULL;
+        if (sym->st_shndx == SHN_UNDEF || sym->st_size == 0
+            || elf_get_sym_offset(sym, &offset) != ELF_OK
+            || elf_offset(offset, sym->st_size, &text) != ELF_OK) {
+            table->offset[j] = offset;
+            table->size[j] = 0;
+            table->endbr64[j] = 0;
+            table->padding[j] = 0;
+            table->prefix[j] = 0;
+            j++;
+            continue;
+        }
+
+        table->offset[j] = offset;
+        table->size[j] = sym->st_size;
+        elf_scan_func_prologue(text, sym->st_size, &table->endbr64[j], &table->padding[j]);
+        table->prefix[j] = 0;
+        j++;
+    }
+
+    elf_check(elf_scan_func_prefixes(table));
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_get_func_table(const elf_func_table** table_ref)
+{
+    if (table_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    if (elfctx->functable_block == NULL) {
+        elf_check(elf_build_func_table());
+    }
+
+    *table_ref = &elfctx->functable;
+    return elf_stack_error(ELF_OK);
+}
+
 int elf_print_sym_bytes_2(Elf64_Sym* sym)
 {
     elf_ro_bytebuff buffer;
@@ -622,7 +1789,7 @@ int elf_print_sym_bytes(Elf64_Sym* func_sym, elf_ro_bytebuff bytes, size_t size)
     elf_pnewl((void*)size);
     elf_unewl((size_t)size);
 
-    uint8_t* b = elfpv.data + offset;
+    uint8_t* b = elfctx->data + offset;
 
     printf("\n%-12i ", 0);
     for (size_t i = 0; i < row_length; i++) {
@@ -38,6 +38,7 @@ typedef enum {
     ELF_ERR_INVALID_SIZE,
     ELF_ERR_NULL,
     ELF_ERR_NOT_IMPL,
+    ELF_ERR_WRITE,
 } elf_error_code;
 
 typedef struct {
@@ -50,11 +51,29 @@ typedef struct {
 #define ELF_TRACE_SIZE 1024
 typedef struct {
     elf_error trace[ELF_TRACE_SIZE];
+    size_t head;
     size_t length;
-    uint64_t old;
-    time_t timestamp;
+    size_t errors;
 } elf_trace;
 
+typedef enum {
+    ELF_LOAD_READ,
+    ELF_LOAD_MMAP,
+} elf_load_mode;
+
+typedef struct elf_context elf_context;
+
+typedef struct {
+    size_t length;
+    Elf64_Sym** symbol;
+    size_t* offset;
+    size_t* size;
+    const char** name;
+    uint8_t* endbr64;
+    uint32_t* padding;
+    uint32_t* prefix;
+} elf_func_table;
+
 typedef struct {
     void* object;
     uint64_t index;
@@ -69,13 +88,25 @@ void elf_reset_error_trace(void);
 
 int elf_has_error(void);
 
+size_t elf_error_count(void);
+
 #define elf_print_error_trace() elf_print_to_file_error_trace(stdout)
 void elf_print_to_file_error_trace(FILE* output);
 
+int elf_create_context(elf_context** context_ref);
+
+int elf_destroy_context(elf_context* context);
+
+int elf_bind_context(elf_context* context);
+
+elf_context* elf_current_context(void);
+
 int elf_elf_loaded(void);
 
 int elf_load_elf(const char* path);
 
+int elf_load_elf_wmode(const char* path, elf_load_mode mode);
+
 int elf_unload_elf(void);
 
 int elf_save_elf(const char* path);
@@ -94,10 +125,26 @@ int elf_get_phdr_windex(size_t index, Elf64_Phdr** phdr_ref);
 
 int elf_print_phdr(Elf64_Phdr* phdr);
 
+int elf_build_segment_table(void);
+
+int elf_vaddr_to_offset(Elf64_Addr vaddr, size_t* offset_ref);
+
+int elf_offset_to_vaddr(size_t offset, Elf64_Addr* vaddr_ref);
+
+int elf_append_segment(size_t size, Elf64_Word flags, Elf64_Addr* vaddr_ref, elf_bytebuffer* buf_ref);
+
+int elf_extend_bss(size_t size, size_t align, Elf64_Addr* vaddr_ref);
+
+int elf_set_append_vaddr(Elf64_Addr vaddr);
+
+int elf_apply_elf(uintptr_t base, Elf64_Addr mapped_end);
+
 int elf_get_shdr_strtab_shdr(Elf64_Shdr** shdr_ref);
 
 int elf_get_shdr_windex(size_t index, Elf64_Shdr** shdr_ref);
 
+int elf_build_shdr_index(void);
+
 int elf_get_shdr_wname(const char* name, Elf64_Shdr** shdr_ref);
 
 int elf_get_shdr_wtype(Elf64_Word type, Elf64_Shdr** shdr_ref);
@@ -122,6 +169,8 @@ int elf_get_sym_shdr(Elf64_Shdr** shdr_ref);
 
 int elf_get_sym_windex(Elf64_Shdr* sym_sh, size_t index, Elf64_Sym** sym_ref);
 
+int elf_build_sym_index(Elf64_Shdr* sym_sh);
+
 int elf_get_sym_wname(Elf64_Shdr* sym_sh, const char* name, Elf64_Sym** sym_ref);
 
 int elf_get_sym_wtype(Elf64_Shdr* sym_sh, uint16_t type, elf_index_iterator* iterator_ref);
@@ -132,6 +181,12 @@ int elf_get_readonly_sym_bytes(Elf64_Sym* sym, elf_ro_bytebuff* const buf_ref, s
 
 int elf_set_sym_bytes(Elf64_Sym* sym, size_t offset, elf_bytebuffer buf, size_t size);
 
+int elf_set_file_bytes(size_t offset, elf_bytebuffer buf, size_t size);
+
+int elf_scan_func_prologue(elf_ro_bytebuff text, size_t size, uint8_t* endbr64_ref, uint32_t* padding_ref);
+
+int elf_get_func_table(const elf_func_table** table_ref);
+
 int elf_print_sym(Elf64_Shdr* sym_sh, Elf64_Sym* sym);
 
 int elf_print_sym_bytes(Elf64_Sym* sym, elf_ro_bytebuff bytes, size_t size);
@@ -140,8 +195,23 @@ int elf_print_sym_bytes_2(Elf64_Sym* sym);
 
 int elf_print_sym_shdr(Elf64_Shdr* sym_sh);
 
+// successful calls are only traced when built with -DELF_TRACE_SUCCESS,
+// otherwise elf_stack_error(ELF_OK) folds to a constant.
+#ifdef ELF_TRACE_SUCCESS
 #define elf_stack_error(code) \
     elf_stack_error_struct((elf_error) { __FILE__, __func__, __LINE__, code })
+#else
+#define elf_stack_error(code) \
+    elf_stack_error_failure(code, __FILE__, __func__, __LINE__)
+#endif
+
+static inline int elf_stack_error_failure(int code, const char* file, const char* func, int line)
+{
+    if (__builtin_expect(code == ELF_OK, 1)) {
+        return ELF_OK;
+    }
+    return elf_stack_error_struct((elf_error) { file, func, line, code });
+}
 
 #define elf_check(expr)                  \
     {                                    \
@@ -0,0 +1,760 @@
+/*
+    Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
+
+    Function manifest: the content hash, size and patch state of every
+    function of an ELF, saved next to a patched executable as <output>.gtm.
+
+    Format:
+        gtm <manifest version> <patch layout version>
+        <hash, 32 hex digits> <size> <state> <name>
+        ...
+
+    Hashes cover the bytes of a function before it is patched, without
+    what depends on where it was linked: the displacement of a branch or a
+    rip-relative operand is replaced by its offset when it stays in the
+    function, by the name of the symbol or got slot it reaches otherwise
+    (through the stub for plt calls), and by zero when it reaches unnamed
+    data such as string literals. Absolute addresses of non-pie code are
+    still part of the bytes.
+*/
+
+#include "manifest.h"
+#include "patch.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    Elf64_Addr address;
+    Elf64_Xword size;
+    const char* name;
+} elf_hash_target;
+
+typedef struct {
+    size_t length;
+    elf_hash_target* target;
+    size_t end_length;
+    elf_hash_target* end;
+} elf_hash_targets;
+
+typedef struct {
+    uint8_t offset;
+    uint8_t size;
+} elf_insn_relative;
+
+static const char* elf_func_state_name[] = {
+    [ELF_FUNC_SKIPPED] = "skipped",
+    [ELF_FUNC_PATCHED] = "patched",
+    [ELF_FUNC_ENTRY] = "entry",
+};
+
+int elf_alloc_manifest(size_t length, elf_manifest* manifest_ref)
+{
+    if (manifest_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    manifest_ref->entry = calloc(length + 1, sizeof(*manifest_ref->entry));
+    if (manifest_ref->entry == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    manifest_ref->length = length;
+    manifest_ref->text = NULL;
+    return elf_stack_error(ELF_OK);
+}
+
+void elf_free_manifest(elf_manifest* manifest)
+{
+    if (manifest != NULL) {
+        free(manifest->entry);
+        free(manifest->text);
+        *manifest = (elf_manifest) { 0 };
+    }
+}
+
+static int elf_insn_is_prefix(uint8_t byte)
+{
+    switch (byte) {
+    case 0x26:
+    case 0x2e:
+    case 0x36:
+    case 0x3e:
+    case 0x64 ... 0x67:
+    case 0xf0:
+    case 0xf2:
+    case 0xf3:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int elf_insn_0f_modrm(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x05 ... 0x09:
+    case 0x0b:
+    case 0x0e:
+    case 0x30 ... 0x37:
+    case 0x77:
+    case 0xa0 ... 0xa2:
+    case 0xa8 ... 0xaa:
+    case 0xc8 ... 0xcf:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+static int elf_insn_0f_imm8(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x70 ... 0x73:
+    case 0xa4:
+    case 0xac:
+    case 0xba:
+    case 0xc2 ... 0xc6:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// length of the x86-64 instruction at code, 0 when it cannot be decoded.
+// the relative operand is a branch displacement or a rip-relative disp32,
+// both relative to the end of the instruction.
+static size_t elf_insn_length(const uint8_t* code, size_t size, elf_insn_relative* relative_ref)
+{
+    size_t i = 0;
+    int operand16 = 0;
+    int address32 = 0;
+    int rex_w = 0;
+    *relative_ref = (elf_insn_relative) { 0 };
+
+    while (i < size && elf_insn_is_prefix(code[i])) {
+        operand16 |= code[i] == 0x66;
+        address32 |= code[i] == 0x67;
+        i++;
+    }
+    if (i < size && (code[i] & 0xf0) == 0x40) {
+        rex_w = (code[i++] & 0x08) != 0;
+    }
+    if (i >= size) {
+        return 0;
+    }
+
+    uint8_t opcode = code[i++];
+    size_t imm32 = operand16 ? 2 : 4;
+    size_t imm = 0;
+    size_t rel = 0;
+    int modrm = 0;
+
+    if (opcode == 0xc4 || opcode == 0xc5 || opcode == 0x62) {
+        // vex and evex carry the opcode map, every opcode but vzeroupper and
+        // vzeroall has a modrm byte.
+        size_t payload = (opcode == 0xc5) ? 1 : (opcode == 0xc4) ? 2 : 3;
+        if (i + payload >= size) {
+            return 0;
+        }
+        int map = (opcode == 0xc5) ? 1 : code[i] & ((opcode == 0x62) ? 0x07 : 0x1f);
+        i += payload;
+        imm = (map == 3 || (map == 1 && elf_insn_0f_imm8(code[i]))) ? 1 : 0;
+        modrm = !(map == 1 && code[i] == 0x77);
+        i++;
+    } else if (opcode == 0x0f) {
+        if (i >= size) {
+            return 0;
+        }
+        uint8_t second = code[i++];
+        if (second == 0x38 || second == 0x3a) {
+            imm = (second == 0x3a);
+            modrm = 1;
+            i++;
+        } else if (second >= 0x80 && second <= 0x8f) {
+            rel = 4;
+        } else {
+            imm = elf_insn_0f_imm8(second) || second == 0x0f;
+            modrm = elf_insn_0f_modrm(second);
+        }
+    } else {
+        switch (opcode) {
+        case 0x00 ... 0x3f:
+            if ((opcode & 0x07) < 4) {
+                modrm = 1;
+            } else if ((opcode & 0x07) == 4) {
+                imm = 1;
+            } else if ((opcode & 0x07) == 5) {
+                imm = imm32;
+            } else {
+                return 0;
+            }
+            break;
+        case 0x50 ... 0x5f:
+        case 0x6c ... 0x6f:
+        case 0x90 ... 0x99:
+        case 0x9b ... 0x9f:
+        case 0xa4 ... 0xa7:
+        case 0xaa ... 0xaf:
+        case 0xc3:
+        case 0xc9:
+        case 0xcb:
+        case 0xcc:
+        case 0xcf:
+        case 0xd7:
+        case 0xec ... 0xef:
+        case 0xf1:
+        case 0xf4:
+        case 0xf5:
+        case 0xf8 ... 0xfd:
+            break;
+        case 0x63:
+        case 0x84 ... 0x8f:
+        case 0xd0 ... 0xd3:
+        case 0xd8 ... 0xdf:
+        case 0xfe:
+        case 0xff:
+            modrm = 1;
+            break;
+        case 0x6a:
+        case 0xa8:
+        case 0xb0 ... 0xb7:
+        case 0xcd:
+        case 0xe4 ... 0xe7:
+            imm = 1;
+            break;
+        case 0x68:
+        case 0xa9:
+            imm = imm32;
+            break;
+        case 0x6b:
+        case 0x80:
+        case 0x83:
+        case 0xc0:
+        case 0xc1:
+        case 0xc6:
+        case 0xf6:
+            modrm = 1;
+            imm = 1;
+            break;
+        case 0x69:
+        case 0x81:
+        case 0xc7:
+        case 0xf7:
+            modrm = 1;
+            imm = imm32;
+            break;
+        case 0xa0 ... 0xa3:
+            imm = address32 ? 4 : 8;
+            break;
+        case 0xb8 ... 0xbf:
+            imm = rex_w ? 8 : imm32;
+            break;
+        case 0xc2:
+        case 0xca:
+            imm = 2;
+            break;
+        case 0xc8:
+            imm = 3;
+            break;
+        case 0x70 ... 0x7f:
+        case 0xe0 ... 0xe3:
+        case 0xeb:
+            rel = 1;
+            break;
+        case 0xe8:
+        case 0xe9:
+            rel = 4;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    if (modrm) {
+        if (i >= size) {
+            return 0;
+        }
+        uint8_t byte = code[i++];
+        uint8_t mod = byte >> 6;
+        uint8_t rm = byte & 0x07;
+
+        // test has an immediate for /0 and /1 only, xbegin is c7 f8 rel32.
+        if ((opcode == 0xf6 || opcode == 0xf7) && (byte & 0x38) > 0x08) {
+            imm = 0;
+        } else if (opcode == 0xc7 && byte == 0xf8) {
+            imm = 0;
+            rel = 4;
+        }
+
+        size_t disp = (mod == 1) ? 1 : (mod == 2) ? 4 : 0;
+        if (mod != 3 && rm == 4) {
+            if (i >= size) {
+                return 0;
+            }
+            disp = (mod == 0 && (code[i] & 0x07) == 5) ? 4 : disp;
+            i++;
+        } else if (mod == 0 && rm == 5) {
+            *relative_ref = (elf_insn_relative) { .offset = i, .size = 4 };
+            disp = 4;
+        }
+        i += disp;
+    }
+
+    if (rel != 0) {
+        *relative_ref = (elf_insn_relative) { .offset = i, .size = rel };
+    }
+
+    i += rel + imm;
+    return (i <= size && i <= 15) ? i : 0;
+}
+
+static int elf_compare_hash_target(const void* a, const void* b)
+{
+    const elf_hash_target* x = a;
+    const elf_hash_target* y = b;
+    if (x->address != y->address) {
+        return (x->address > y->address) - (x->address < y->address);
+    }
+    return strcmp(x->name, y->name);
+}
+
+static const char* elf_hash_target_name(Elf64_Shdr* strtab_sh, Elf64_Word index)
+{
+    const char* strtab;
+    if (index == 0 || index >= strtab_sh->sh_size
+        || elf_offset(strtab_sh->sh_offset, strtab_sh->sh_size, (void**)&strtab) != ELF_OK
+        || memchr(strtab + index, '\0', strtab_sh->sh_size - index) == NULL) {
+        return NULL;
+    }
+    return strtab + index;
+}
+
+static int elf_add_symbol_targets(Elf64_Shdr* sym_sh, elf_hash_targets* targets)
+{
+    Elf64_Shdr* strtab_sh;
+    size_t sym_num;
+    elf_check(elf_get_sym_strtab_shdr(sym_sh, &strtab_sh));
+    elf_check(elf_get_sym_num(sym_sh, &sym_num));
+
+    for (size_t i = 0; i < sym_num; i++) {
+        Elf64_Sym* sym;
+        elf_check(elf_get_sym_windex(sym_sh, i, &sym));
+
+        int type = ELF64_ST_TYPE(sym->st_info);
+        const char* name = elf_hash_target_name(strtab_sh, sym->st_name);
+        if ((type == STT_FUNC || type == STT_OBJECT) && sym->st_shndx != SHN_UNDEF && name != NULL) {
+            targets->target[targets->length++] = (elf_hash_target) { sym->st_value, sym->st_size, name };
+        }
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+// dynamic relocations name the got slots that plt stubs and -fno-plt calls load.
+static int elf_add_slot_targets(Elf64_Shdr* rela_sh, elf_hash_targets* targets)
+{
+    Elf64_Shdr* dynsym_sh;
+    Elf64_Shdr* strtab_sh;
+    elf_check(elf_get_shdr_windex(rela_sh->sh_link, &dynsym_sh));
+    if (dynsym_sh->sh_type != SHT_DYNSYM || rela_sh->sh_entsize != sizeof(Elf64_Rela)) {
+        return elf_stack_error(ELF_OK);
+    }
+    elf_check(elf_get_shdr_windex(dynsym_sh->sh_link, &strtab_sh));
+
+    size_t rela_num = rela_sh->sh_size / sizeof(Elf64_Rela);
+    size_t sym_num = (dynsym_sh->sh_entsize != 0) ? dynsym_sh->sh_size / dynsym_sh->sh_entsize : 0;
+    Elf64_Rela* relas;
+    elf_check(elf_offset(rela_sh->sh_offset, rela_sh->sh_size, (void**)&relas));
+
+    for (size_t i = 0; i < rela_num; i++) {
+        size_t index = ELF64_R_SYM(relas[i].r_info);
+        Elf64_Sym* sym;
+        if (index == 0 || index >= sym_num
+            || elf_offset(dynsym_sh->sh_offset + index * dynsym_sh->sh_entsize, sizeof(*sym), (void**)&sym) != ELF_OK) {
+            continue;
+        }
+
+        const char* name = elf_hash_target_name(strtab_sh, sym->st_name);
+        if (name != NULL) {
+            targets->target[targets->length++] = (elf_hash_target) { relas[i].r_offset, sizeof(Elf64_Addr), name };
+        }
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_is_identifier(const char* name)
+{
+    static const char chars[] = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    return name[0] != '\0' && !(name[0] >= '0' && name[0] <= '9') && name[strspn(name, chars)] == '\0';
+}
+
+// the linker defines __stop_<name> at the end of a section named like a c
+// identifier; that address is also where the next object starts.
+static int elf_add_section_ends(Elf64_Ehdr* hdr, elf_hash_targets* targets)
+{
+    Elf64_Shdr* shstrtab_sh;
+    if (elf_get_shdr_strtab_shdr(&shstrtab_sh) != ELF_OK) {
+        return elf_stack_error(ELF_OK);
+    }
+
+    for (size_t s = 0; s < hdr->e_shnum; s++) {
+        Elf64_Shdr* sh;
+        elf_check(elf_get_shdr_windex(s, &sh));
+        const char* name = elf_hash_target_name(shstrtab_sh, sh->sh_name);
+        if (!(sh->sh_flags & SHF_ALLOC) || name == NULL || !elf_is_identifier(name)) {
+            continue;
+        }
+        targets->end[targets->end_length++] = (elf_hash_target) { sh->sh_addr + sh->sh_size, 0, name };
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+// every named address a function can reach, sorted by address then name.
+static int elf_build_hash_targets(elf_hash_targets* targets_ref)
+{
+    Elf64_Ehdr* hdr;
+    elf_check(elf_get_hdr(&hdr));
+    *targets_ref = (elf_hash_targets) { 0 };
+
+    // displacements of relocatable files are placeholders, they do not depend on placement.
+    if (hdr->e_type == ET_REL) {
+        return elf_stack_error(ELF_OK);
+    }
+
+    size_t capacity = 0;
+    for (size_t s = 0; s < hdr->e_shnum; s++) {
+        Elf64_Shdr* sh;
+        elf_check(elf_get_shdr_windex(s, &sh));
+        if ((sh->sh_type == SHT_SYMTAB || sh->sh_type == SHT_RELA) && sh->sh_entsize != 0) {
+            capacity += sh->sh_size / sh->sh_entsize;
+        }
+    }
+
+    targets_ref->target = malloc((capacity + 1) * sizeof(*targets_ref->target));
+    targets_ref->end = malloc((hdr->e_shnum + 1) * sizeof(*targets_ref->end));
+    if (targets_ref->target == NULL || targets_ref->end == NULL) {
+        free(targets_ref->target);
+        free(targets_ref->end);
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    for (size_t s = 0; s < hdr->e_shnum; s++) {
+        Elf64_Shdr* sh;
+        int error = elf_get_shdr_windex(s, &sh);
+        if (error == ELF_OK && sh->sh_type == SHT_SYMTAB) {
+            error = elf_add_symbol_targets(sh, targets_ref);
+        } else if (error == ELF_OK && sh->sh_type == SHT_RELA) {
+            error = elf_add_slot_targets(sh, targets_ref);
+        }
+        if (error != ELF_OK) {
+            free(targets_ref->target);
+            free(targets_ref->end);
+            return elf_stack_error(error);
+        }
+    }
+
+    int error = elf_add_section_ends(hdr, targets_ref);
+    if (error != ELF_OK) {
+        free(targets_ref->target);
+        free(targets_ref->end);
+        return elf_stack_error(error);
+    }
+
+    qsort(targets_ref->target, targets_ref->length, sizeof(*targets_ref->target), elf_compare_hash_target);
+    return elf_stack_error(ELF_OK);
+}
+
+static const elf_hash_target* elf_find_hash_target(const elf_hash_targets* targets, Elf64_Addr address)
+{
+    // first entry after the last one at or before the address.
+    size_t low = 0;
+    size_t high = targets->length;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (targets->target[mid].address <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == 0) {
+        return NULL;
+    }
+
+    // aliases are sorted by name, the first one that holds the address wins.
+    size_t first = low;
+    while (first > 0 && targets->target[first - 1].address == targets->target[low - 1].address) {
+        first--;
+    }
+    for (size_t k = first; k < low; k++) {
+        const elf_hash_target* target = &targets->target[k];
+        if (address - target->address < ((target->size != 0) ? target->size : 1)) {
+            return target;
+        }
+    }
+    return NULL;
+}
+
+// a plt stub is [endbr64] [bnd] jmp qword ptr [rip + offset32] to its got slot.
+static int elf_find_plt_slot(Elf64_Addr address, Elf64_Addr* slot_ref)
+{
+    static const uint8_t endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+    size_t offset;
+    uint8_t* stub;
+    if (elf_vaddr_to_offset(address, &offset) != ELF_OK || elf_offset(offset, 16, (void**)&stub) != ELF_OK) {
+        return 0;
+    }
+
+    size_t i = (memcmp(stub, endbr64, sizeof(endbr64)) == 0) ? sizeof(endbr64) : 0;
+    i += (stub[i] == 0xf2);
+    if (stub[i] != 0xff || stub[i + 1] != 0x25) {
+        return 0;
+    }
+
+    int32_t displacement;
+    memcpy(&displacement, stub + i + 2, sizeof(displacement));
+    *slot_ref = address + i + 6 + displacement;
+    return 1;
+}
+
+static uint32_t elf_hash_relative_target(const elf_hash_targets* targets, Elf64_Addr start, size_t size, Elf64_Addr target)
+{
+    if (target - start < size) {
+        return (uint32_t)(target - start);
+    }
+
+    uint64_t hash[2];
+    for (size_t k = 0; k < targets->end_length; k++) {
+        if (targets->end[k].address == target) {
+            elf_hash_bytes(targets->end[k].name, strlen(targets->end[k].name), UINT64_MAX, hash);
+            return (uint32_t)hash[0];
+        }
+    }
+
+    const elf_hash_target* named = elf_find_hash_target(targets, target);
+    if (named == NULL && elf_find_plt_slot(target, &target)) {
+        named = elf_find_hash_target(targets, target);
+    }
+    if (named == NULL) {
+        return 0;
+    }
+
+    elf_hash_bytes(named->name, strlen(named->name), target - named->address, hash);
+    return (uint32_t)hash[0];
+}
+
+static int elf_hash_manifest_entry(const elf_hash_targets* targets, const elf_func_table* table, size_t index, elf_manifest_entry* entry_ref)
+{
+    Elf64_Ehdr* hdr;
+    elf_check(elf_get_hdr(&hdr));
+
+    size_t size = table->size[index];
+    uint8_t* text = NULL;
+    if (size != 0) {
+        elf_check(elf_offset(table->offset[index], size, (void**)&text));
+    }
+
+    uint8_t* code = malloc(size + 1);
+    if (code == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+    memcpy(code, text, size);
+
+    // an undecodable byte ends the walk, the rest of the function is hashed as is.
+    Elf64_Addr start = (hdr->e_type == ET_REL) ? table->offset[index] : table->symbol[index]->st_value;
+    size_t length;
+    elf_insn_relative relative;
+    for (size_t i = 0; i < size && (length = elf_insn_length(code + i, size - i, &relative)) != 0; i += length) {
+        if (relative.size == 0) {
+            continue;
+        }
+
+        int32_t displacement = (int8_t)code[i + relative.offset];
+        if (relative.size == 4) {
+            memcpy(&displacement, code + i + relative.offset, sizeof(displacement));
+        }
+        uint32_t value = elf_hash_relative_target(targets, start, size, start + i + length + displacement);
+        memcpy(code + i + relative.offset, &value, relative.size);
+    }
+
+    entry_ref->name = table->name[index];
+    entry_ref->size = size;
+    elf_hash_bytes(code, size, 0, entry_ref->hash);
+    free(code);
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_hash_manifest(const elf_func_table* table, elf_manifest_entry* entries)
+{
+    if (table == NULL || entries == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    elf_hash_targets targets;
+    elf_check(elf_build_hash_targets(&targets));
+
+    int error = ELF_OK;
+    for (size_t i = 0; i < table->length && error == ELF_OK; i++) {
+        error = elf_hash_manifest_entry(&targets, table, i, &entries[i]);
+    }
+
+    free(targets.target);
+    free(targets.end);
+    return elf_stack_error(error);
+}
+
+int elf_build_manifest(elf_manifest* manifest_ref)
+{
+    const elf_func_table* table;
+    elf_check(elf_get_func_table(&table));
+    elf_check(elf_alloc_manifest(table->length, manifest_ref));
+
+    // names point into the loaded elf, the manifest lives until it is unloaded.
+    int error = elf_hash_manifest(table, manifest_ref->entry);
+    if (error != ELF_OK) {
+        elf_free_manifest(manifest_ref);
+        return elf_stack_error(error);
+    }
+
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_save_manifest(const char* path, const elf_manifest* manifest)
+{
+    if (path == NULL || manifest == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    fprintf(file, "gtm %i %i\n", ELF_MANIFEST_VERSION, ELF_PATCH_LAYOUT_VERSION);
+    for (size_t i = 0; i < manifest->length; i++) {
+        const elf_manifest_entry* entry = &manifest->entry[i];
+        fprintf(file, "%016lx%016lx %zu %s %s\n", entry->hash[0], entry->hash[1], entry->size,
+            elf_func_state_name[entry->state], entry->name);
+    }
+
+    if (fclose(file) != 0) {
+        return elf_stack_error(ELF_ERR_WRITE);
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_parse_manifest_line(char* line, elf_manifest_entry* entry_ref)
+{
+    char hash[33];
+    char state[16];
+    int name;
+    if (sscanf(line, "%32s %zu %15s %n", hash, &entry_ref->size, state, &name) != 3 || strlen(hash) != 32) {
+        return elf_stack_error(ELF_ERR_ELF);
+    }
+
+    char high[17] = { 0 };
+    memcpy(high, hash, 16);
+    entry_ref->hash[0] = strtoull(high, NULL, 16);
+    entry_ref->hash[1] = strtoull(hash + 16, NULL, 16);
+    entry_ref->name = line + name;
+
+    for (size_t s = 0; s < sizeof(elf_func_state_name) / sizeof(*elf_func_state_name); s++) {
+        if (strcmp(state, elf_func_state_name[s]) == 0) {
+            entry_ref->state = s;
+            return elf_stack_error(ELF_OK);
+        }
+    }
+    return elf_stack_error(ELF_ERR_ELF);
+}
+
+int elf_load_manifest(const char* path, elf_manifest* manifest_ref)
+{
+    if (path == NULL || manifest_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* text = malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, file) != (size_t)size) {
+        free(text);
+        fclose(file);
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+    fclose(file);
+    text[size] = '\0';
+
+    int manifest_version;
+    int layout_version;
+    if (sscanf(text, "gtm %i %i", &manifest_version, &layout_version) != 2 || manifest_version != ELF_MANIFEST_VERSION) {
+        free(text);
+        return elf_stack_error(ELF_ERR_ELF);
+    }
+
+    size_t lines = 0;
+    for (char* c = text; *c != '\0'; c++) {
+        lines += (*c == '\n');
+    }
+
+    int error = elf_alloc_manifest(lines, manifest_ref);
+    if (error != ELF_OK) {
+        free(text);
+        return elf_stack_error(error);
+    }
+    manifest_ref->text = text;
+
+    // the header is skipped, names are terminated in place.
+    size_t length = 0;
+    char* line = strchr(text, '\n');
+    while (line != NULL && *++line != '\0') {
+        char* end = strchr(line, '\n');
+        if (end != NULL) {
+            *end = '\0';
+        }
+
+        error = elf_parse_manifest_line(line, &manifest_ref->entry[length++]);
+        if (error != ELF_OK) {
+            elf_free_manifest(manifest_ref);
+            return elf_stack_error(error);
+        }
+        line = end;
+    }
+
+    manifest_ref->length = length;
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_compare_manifest_entry(const void* a, const void* b)
+{
+    const elf_manifest_entry* x = a;
+    const elf_manifest_entry* y = b;
+    int order = strcmp(x->name, y->name);
+    if (order != 0) {
+        return order;
+    }
+
+    // same-named local functions keep their symbol table order.
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+int elf_sort_manifest(elf_manifest* manifest)
+{
+    if (manifest == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    for (size_t i = 0; i < manifest->length; i++) {
+        manifest->entry[i].order = i;
+    }
+    qsort(manifest->entry, manifest->length, sizeof(*manifest->entry), elf_compare_manifest_entry);
+    return elf_stack_error(ELF_OK);
+}
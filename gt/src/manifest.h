@@ -0,0 +1,44 @@
+/*
+    Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
+*/
+
+#pragma once
+#include "lib.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define ELF_MANIFEST_VERSION 2
+
+typedef enum {
+    ELF_FUNC_SKIPPED,
+    ELF_FUNC_PATCHED,
+    ELF_FUNC_ENTRY,
+} elf_func_state;
+
+typedef struct {
+    const char* name;
+    uint64_t hash[2];
+    size_t size;
+    size_t order;
+    uint8_t state;
+} elf_manifest_entry;
+
+typedef struct {
+    size_t length;
+    elf_manifest_entry* entry;
+    char* text;
+} elf_manifest;
+
+int elf_alloc_manifest(size_t length, elf_manifest* manifest_ref);
+
+void elf_free_manifest(elf_manifest* manifest);
+
+int elf_hash_manifest(const elf_func_table* table, elf_manifest_entry* entries);
+
+int elf_build_manifest(elf_manifest* manifest_ref);
+
+int elf_save_manifest(const char* path, const elf_manifest* manifest);
+
+int elf_load_manifest(const char* path, elf_manifest* manifest_ref);
+
+int elf_sort_manifest(elf_manifest* manifest);
@@ -6,47 +6,63 @@
         https://en.wikipedia.org/wiki/ModR/M
         https://en.wikipedia.org/wiki/REX_prefix
 
-    Patch:
-        0x90,                                       // nop
-        0x48, 0x8b, 0x05, 0xFF, 0xFF, 0xFF, 0xFF,   // mov rax, qword ptr [hijack]    ; offset from next instruction to hijack symbol
-        0x4c, 0x8b, 0x25, 0xed, 0xff, 0xff, 0xff,   // mov r12, qword ptr 0xedffffff  ; offset from next instruction to endbr64
-        0x49, 0x3b, 0xc4,                           // cmp rax, r12
-        0x0f, 0x84, 0x1a, 0x00, 0x00, 0x00,         // jz 0x1a                        ; jumps to start of function, after padding
-        0x55,                                       // push rbp
-        0x48, 0x89, 0xe5,                           // mov rbp, rsp
-        0x48, 0x8b, 0x1d, 0xFF, 0xFF, 0xFF, 0xFF,   // mov rbx, qword ptr [hook]      ; offset from next instruction to hook symbol
-        0x48, 0xc7, 0xc0, 0x00, 0x00, 0x00, 0x00,   // mov rax, 0x0
-        0xff, 0xd3,                                 // call rbx
-        0x5d,                                       // pop rbp
-        0xc3                                        // ret
+    Patch, only r11 is used: it is scratch at a call boundary, and the mock is entered
+    with the caller's arguments, stack and return address, as if it had been called:
+        0x66, 0x90,                                 // nop                            ; the site, see below
+        0x4c, 0x8b, 0x1d, 0xFF, 0xFF, 0xFF, 0xFF,   // mov r11, qword ptr [slot]      ; the function's mock, or null
+        0x4d, 0x85, 0xdb,                           // test r11, r11
+        0x0f, 0x84, 0xFF, 0xFF, 0xFF, 0xFF,         // jz body                        ; first byte after the padding
+        0x41, 0xff, 0xe3,                           // jmp r11
+
+    Compact patch:
+        0xe9, 0xFF, 0xFF, 0xFF, 0xFF,               // jmp stub                       ; at the function entry, after endbr64
+
+    Compact stub, one per function, in a segment appended to the executable:
+        0x4c, 0x8b, 0x1d, 0xFF, 0xFF, 0xFF, 0xFF,   // mov r11, qword ptr [slot]      ; the function's mock, or null
+        0x4d, 0x85, 0xdb,                           // test r11, r11
+        0x0f, 0x84, 0xFF, 0xFF, 0xFF, 0xFF,         // jz body                        ; first byte after the padding
+        0x41, 0xff, 0xe3,                           // jmp r11
+        0xcc, ...                                   // int3                           ; pads the stub to 32 bytes
+
+    Sites: the first two bytes of every patch are its site. The patcher leaves it
+    disarmed, replaced by a short jump past the padding, and the runtime writes the
+    original bytes back while the function is mocked:
+        0xeb, 0xFF,                                 // jmp body                       ; disarmed
+
+    Slots, one per patched address, are appended to the bss of the executable. The
+    sorted table of patched addresses and the bytes of each site go after the stubs,
+    or in a read-only segment for the other patches; gt_patch_table points to them so
+    that gt_set_mock finds the slot and arms the site.
+
+    Prefix patch, for -fpatchable-function-entry=N,M; the stub fills the end of the M nops before the symbol:
+        0x4c, 0x8b, 0x1d, 0xFF, 0xFF, 0xFF, 0xFF,   // mov r11, qword ptr [slot]
+        0x4d, 0x85, 0xdb,                           // test r11, r11
+        0x74, 0xFF,                                 // jz body                        ; first byte after the padding
+        0x41, 0xff, 0xe3,                           // jmp r11
+    function:
+        0xeb, 0xFF,                                 // jmp stub                       ; at the function entry, after endbr64
 */
+#define _GNU_SOURCE
+#include "patch.h"
 #include "gt2.h"
 #include "lib.h"
 #include <elf.h>
+#include <link.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 const static uint8_t NOP = 0x90;
-const static uint32_t ENDBR64 = 0xfa1e0ff3;
 
 typedef struct {
-    uint8_t i0_nop[1];
-    uint8_t i1_mov_rax_qwordptr[3];
-    uint8_t i1_offset32_hijack[4];
-    uint8_t i2_mov_r12_qwordptr[3];
-    uint8_t i2_offset32[4];
-    uint8_t i3_cmp_rax_r12[3];
-    uint8_t i4_jnz_near[2];
-    uint8_t i4_offset32[4];
-    uint8_t i5_push_rbp[1];
-    uint8_t i6_mov_rbp_rsp[3];
-    uint8_t i7_mov_rbx_qwordptr[3];
-    uint8_t i7_offset32_mock[4];
-    uint8_t i8_mov_rax_imm32[3];
-    uint8_t i8_immediate32[4];
-    uint8_t i9_call_rbx[2];
-    uint8_t i10_pop_rbp[1];
-    uint8_t i11_ret[1];
+    uint8_t i0_nop[2];
+    uint8_t i1_mov_r11_qwordptr[3];
+    uint8_t i1_offset32_slot[4];
+    uint8_t i2_test_r11_r11[3];
+    uint8_t i3_jz_near[2];
+    uint8_t i3_offset32_body[4];
+    uint8_t i4_jmp_r11[3];
 } elf_mock_patch_layout;
 
 typedef struct {
@@ -58,8 +74,46 @@ typedef struct {
     uint8_t i5_ret[1];
 } elf_main_patch_layout;
 
+typedef struct {
+    uint8_t i0_jmp_near[1];
+    uint8_t i0_offset32_stub[4];
+} elf_compact_patch_layout;
+
+typedef struct {
+    uint8_t i0_mov_r11_qwordptr[3];
+    uint8_t i0_offset32_slot[4];
+    uint8_t i1_test_r11_r11[3];
+    uint8_t i2_jz_near[2];
+    uint8_t i2_offset32_body[4];
+    uint8_t i3_jmp_r11[3];
+    uint8_t i4_int3[13];
+} elf_compact_stub_layout;
+
+typedef struct {
+    uint8_t i0_mov_r11_qwordptr[3];
+    uint8_t i0_offset32_slot[4];
+    uint8_t i1_test_r11_r11[3];
+    uint8_t i2_jz_short[1];
+    uint8_t i2_offset8_body[1];
+    uint8_t i3_jmp_r11[3];
+} elf_prefix_stub_layout;
+
+typedef struct {
+    uint8_t i0_jmp_short[1];
+    uint8_t i0_offset8_stub[1];
+} elf_prefix_patch_layout;
+
+typedef enum {
+    ELF_SITE_TEST_ENTRY,
+    ELF_SITE_PROGRAM_ENTRY,
+    ELF_SITE_TOO_SMALL,
+    ELF_SITE_PATCH,
+    ELF_SITE_ALIAS,
+} elf_site_kind;
+
 typedef struct {
     size_t offset;
+    size_t address;
     size_t text_size;
     Elf64_Sym* symbol;
     Elf64_Shdr* section;
@@ -76,27 +130,52 @@ typedef struct {
     int entrypoint;
 } elf_function_info;
 
-static elf_mock_patch_layout elf_mock_patch = {
-    .i0_nop = { NOP },                                // 1    | NOP
-    .i1_mov_rax_qwordptr = { 0x48, 0x8b, 0x05 },      // 3    | MOV RAX, qword ptr [offset32]
-    .i1_offset32_hijack = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to target function pointer
-    .i2_mov_r12_qwordptr = { 0x4c, 0x8b, 0x25 },      // 3    | MOV R12, qword ptr [offset32]
-    .i2_offset32 = { 0xed, 0xff, 0xff, 0xff },        // 4    | offset32 -> offset from IP to first byte of current function
-    .i3_cmp_rax_r12 = { 0x49, 0x3b, 0xc4 },           // 3    | CMP RAX, R12
-    .i4_jnz_near = { 0x0f, 0x85 },                    // 2    | JNZ offset32
-    .i4_offset32 = { 0x1a, 0x00, 0x00, 0x00 },        // 4    | offset32 -> offset from IP to next instruction
-    .i5_push_rbp = { 0x55 },                          // 1    | PUSH RBP
-    .i6_mov_rbp_rsp = { 0x48, 0x89, 0xe5 },           // 3    | MOV RBP, RSP
-    .i7_mov_rbx_qwordptr = { 0x48, 0x8b, 0x1d },      // 3    | MOV RBX, qword ptr [offset32]
-    .i7_offset32_mock = { 0xff, 0xff, 0xff, 0xff },   // 4    | offset32 -> offset from IP to mock function pointer
-    .i8_mov_rax_imm32 = { 0x48, 0xc7, 0xc0 },         // 3    | MOV RAX, immediate32
-    .i8_immediate32 = { 0x00, 0x00, 0x00, 0x00 },     // 4    | immediate32 -> literal 32 bits integer value
-    .i9_call_rbx = { 0xff, 0xd3 },                    // 2    | CALL RBX
-    .i10_pop_rbp = { 0x5d },                          // 1    | POP RBP
-    .i11_ret = { 0xc3 }                               // 1    | RET
+#define ELF_PATCH_MAX_THREADS 64
+#define ELF_PATCH_CHUNK_MIN 4096
+
+typedef struct {
+    size_t address;
+    size_t index;
+} elf_patch_site;
+
+// decided before the workers start: how each function is patched and which slot it uses.
+typedef struct {
+    uint8_t* kind;
+    uint32_t* slot;
+    elf_patch_site* site;
+    gt_patch_toggle* toggles;
+    size_t slot_num;
+    size_t slots;
+    elf_bytebuffer stubs;
+    size_t stub_address;
+} elf_patch_plan;
+
+typedef struct {
+    elf_context* context;
+    const elf_func_table* table;
+    size_t begin;
+    size_t end;
+    size_t gtmain;
+    size_t entry;
+    int verbose;
+    elf_patch_mode mode;
+    const elf_patch_plan* plan;
+    elf_manifest_entry* manifest;
+    elf_patch_stats stats;
+    int error;
+} elf_patch_chunk;
+
+static const elf_mock_patch_layout elf_mock_patch = {
+    .i0_nop = { 0x66, NOP },                        // 2    | NOP
+    .i1_mov_r11_qwordptr = { 0x4c, 0x8b, 0x1d },    // 3    | MOV R11, qword ptr [offset32]
+    .i1_offset32_slot = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to the function's mock slot
+    .i2_test_r11_r11 = { 0x4d, 0x85, 0xdb },        // 3    | TEST R11, R11
+    .i3_jz_near = { 0x0f, 0x84 },                   // 2    | JZ offset32
+    .i3_offset32_body = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to first byte after the padding
+    .i4_jmp_r11 = { 0x41, 0xff, 0xe3 },             // 3    | JMP R11
 };
 
-static elf_main_patch_layout elf_main_patch = {
+static const elf_main_patch_layout elf_main_patch = {
     .i0_push_rbp = { 0x55 },                        // 1    | PUSH RBP
     .i1_mov_rbp_rsp = { 0x48, 0x89, 0xe5 },         // 3    | MOV RBP, RSP
     .i3_call_near = { 0xe8 },                       // 1    | CALL (near)
@@ -105,6 +184,42 @@ static elf_main_patch_layout elf_main_patch = {
     .i5_ret = { 0xc3 }                              // 1    | RET
 };
 
+static const elf_compact_patch_layout elf_compact_patch = {
+    .i0_jmp_near = { 0xe9 },                      // 1    | JMP offset32
+    .i0_offset32_stub = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to the function's stub
+};
+
+static const elf_compact_stub_layout elf_compact_stub = {
+    .i0_mov_r11_qwordptr = { 0x4c, 0x8b, 0x1d },    // 3    | MOV R11, qword ptr [offset32]
+    .i0_offset32_slot = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to the function's mock slot
+    .i1_test_r11_r11 = { 0x4d, 0x85, 0xdb },        // 3    | TEST R11, R11
+    .i2_jz_near = { 0x0f, 0x84 },                   // 2    | JZ offset32
+    .i2_offset32_body = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to first byte after the padding
+    .i3_jmp_r11 = { 0x41, 0xff, 0xe3 },             // 3    | JMP R11
+    .i4_int3 = { 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc }, // 13 | INT3
+};
+
+static const elf_prefix_stub_layout elf_prefix_stub = {
+    .i0_mov_r11_qwordptr = { 0x4c, 0x8b, 0x1d },    // 3    | MOV R11, qword ptr [offset32]
+    .i0_offset32_slot = { 0xff, 0xff, 0xff, 0xff }, // 4    | offset32 -> offset from IP to the function's mock slot
+    .i1_test_r11_r11 = { 0x4d, 0x85, 0xdb },        // 3    | TEST R11, R11
+    .i2_jz_short = { 0x74 },                        // 1    | JZ offset8
+    .i2_offset8_body = { 0xff },                    // 1    | offset8 -> offset from IP to first byte after the padding
+    .i3_jmp_r11 = { 0x41, 0xff, 0xe3 },             // 3    | JMP R11
+};
+
+static const elf_prefix_patch_layout elf_prefix_patch = {
+    .i0_jmp_short = { 0xeb },    // 1    | JMP offset8
+    .i0_offset8_stub = { 0xff }, // 1    | offset8 -> offset from IP to the stub, before the function
+};
+
+// padding needed at the function entry by each mode.
+static const uint32_t elf_patch_min_padding[] = {
+    [ELF_PATCH_INLINE] = sizeof(elf_mock_patch_layout),
+    [ELF_PATCH_COMPACT] = sizeof(elf_compact_patch_layout),
+    [ELF_PATCH_PREFIX] = sizeof(elf_prefix_patch_layout),
+};
+
 static int elf_check_elf_type(void)
 {
     Elf64_Ehdr* elf_header;
@@ -112,9 +227,12 @@ static int elf_check_elf_type(void)
 
     switch (elf_header->e_type) {
     case ET_EXEC:
-    case ET_REL:
     case ET_DYN:
         return elf_stack_error(ELF_OK);
+    case ET_REL:
+        // patches point to the slot table, which needs a segment of its own.
+        puts("Relocatable files cannot be patched, link them first.");
+        return elf_stack_error(ELF_ERR_TYPE);
     default:
         printf("Unsupported ELF type. (%hu)\n", elf_header->e_type);
         return elf_stack_error(ELF_ERR_TYPE);
@@ -123,7 +241,7 @@ static int elf_check_elf_type(void)
 
 static void elf_print_divider(const char* name, size_t length)
 {
-    static char divider[64] = { 0 };
+    char divider[64] = { 0 };
     unsigned writeable = 60;
     unsigned spread = (writeable - length) / 2;
 
@@ -136,6 +254,22 @@ static void elf_print_divider(const char* name, size_t length)
     printf("%s\n", divider);
 }
 
+static int elf_get_sym_address(Elf64_Sym* symbol, size_t* address_ref)
+{
+    Elf64_Ehdr* elf_header;
+    elf_check(elf_get_hdr(&elf_header));
+
+    // rel32 displacements are computed between run-time addresses; relocatable
+    // files have no such addresses, their file offsets are used instead.
+    if (elf_header->e_type == ET_REL) {
+        elf_check(elf_get_sym_offset(symbol, address_ref));
+    } else {
+        *address_ref = symbol->st_value;
+    }
+
+    return elf_stack_error(ELF_OK);
+}
+
 int elf_load_symbol_info(Elf64_Shdr* section, Elf64_Sym* symbol, elf_symbol_info* info_ref)
 {
     if (!section || !symbol || !info_ref) {
@@ -143,6 +277,7 @@ int elf_load_symbol_info(Elf64_Shdr* section, Elf64_Sym* symbol, elf_symbol_info
     }
 
     elf_check(elf_get_sym_offset(symbol, &info_ref->offset));
+    elf_check(elf_get_sym_address(symbol, &info_ref->address));
     elf_check(elf_get_readonly_sym_bytes(symbol, &info_ref->text, &info_ref->text_size));
     elf_check(elf_get_sym_strtab_shdr(section, &info_ref->name_section));
     elf_check(elf_get_strtab_shdr_text(info_ref->name_section, symbol->st_name, &info_ref->name));
@@ -160,164 +295,676 @@ static int elf_load_function_info(Elf64_Shdr* section, Elf64_Sym* symbol, elf_fu
 
     elf_check(elf_load_symbol_info(section, symbol, &info_ref->symbol));
 
-    // check if function starts with ENDBR64
-    const uint8_t* text = info_ref->symbol.text;
-    const uint32_t* text_endbr64 = (const uint32_t*)text;
-    info_ref->endbr64 = (*text_endbr64 == ENDBR64) ? sizeof(ENDBR64) : 0;
-    text += info_ref->endbr64;
+    uint8_t endbr64;
+    uint32_t padding;
+    elf_check(elf_scan_func_prologue(info_ref->symbol.text, info_ref->symbol.text_size, &endbr64, &padding));
+    info_ref->endbr64 = endbr64;
+    info_ref->padding = padding;
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_patch_entrypoint(elf_function_info* entry, elf_function_info* test_entry)
+{
+    elf_main_patch_layout patch = elf_main_patch;
+    int32_t* test_entry_ptr = (int32_t*)&patch.i3_offset32_main[0];
+
+    int32_t offset = entry->symbol.address + entry->endbr64 + (uint8_t*)(test_entry_ptr + 1) - (uint8_t*)&patch;
+    *test_entry_ptr = test_entry->symbol.address - offset;
+
+    elf_check(elf_set_sym_bytes(entry->symbol.symbol, entry->endbr64, (uint8_t*)&patch, sizeof(patch)));
+    return elf_stack_error(ELF_OK);
+}
+
+static void elf_set_rel32(uint8_t* field, const void* patch, size_t address, size_t target)
+{
+    // displacements are relative to the end of the field, which ends every instruction here.
+    int32_t offset = target - (address + (field + 4 - (const uint8_t*)patch));
+    memcpy(field, &offset, sizeof(offset));
+}
+
+static int elf_patch_function(const elf_func_table* table, size_t index, const elf_patch_plan* plan)
+{
+    size_t site;
+    elf_check(elf_get_sym_address(table->symbol[index], &site));
+    site += table->endbr64[index];
+    size_t body = site + table->padding[index];
+
+    // patches are built on the stack, several ELFs may be patched concurrently.
+    elf_mock_patch_layout patch = elf_mock_patch;
+    elf_set_rel32(patch.i1_offset32_slot, &patch, site, plan->slots + plan->slot[index] * sizeof(gt_mock_slot));
+    elf_set_rel32(patch.i3_offset32_body, &patch, site, body);
+    elf_check(elf_set_sym_bytes(table->symbol[index], table->endbr64[index], (uint8_t*)&patch, sizeof(patch)));
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_patch_function_compact(const elf_func_table* table, size_t index, elf_patch_chunk* chunk)
+{
+    size_t function;
+    elf_check(elf_get_sym_address(table->symbol[index], &function));
+    size_t site = function + table->endbr64[index];
+    size_t body = site + table->padding[index];
+
+    // stubs are indexed like the slots, one per patched address.
+    const elf_patch_plan* plan = chunk->plan;
+    size_t slot = plan->slot[index];
+    size_t stub_address = plan->stub_address + slot * sizeof(elf_compact_stub_layout);
+    elf_compact_stub_layout* stub = (elf_compact_stub_layout*)plan->stubs + slot;
+    *stub = elf_compact_stub;
+    elf_set_rel32(stub->i0_offset32_slot, stub, stub_address, plan->slots + slot * sizeof(gt_mock_slot));
+    elf_set_rel32(stub->i2_offset32_body, stub, stub_address, body);
+
+    elf_compact_patch_layout patch = elf_compact_patch;
+    elf_set_rel32(patch.i0_offset32_stub, &patch, site, stub_address);
+    elf_check(elf_set_sym_bytes(table->symbol[index], table->endbr64[index], (uint8_t*)&patch, sizeof(patch)));
+    return elf_stack_error(ELF_OK);
+}
 
-    // counts padding
-    info_ref->padding = 0;
-    size_t* padding = &info_ref->padding;
-    const size_t text_size = info_ref->symbol.text_size;
-    while (text[*padding] == NOP && *padding < text_size) {
-        (*padding)++;
+static int elf_patch_entrypoint_compact(elf_function_info* entry, elf_function_info* test_entry)
+{
+    // the entry point tail-jumps to gt_test_main, which returns to its caller.
+    if (entry->padding < sizeof(elf_compact_patch_layout)) {
+        printf("Padding too small (%zu bytes) to patch the entry point.\n", entry->padding);
+        return elf_stack_error(ELF_ERR_INVALID_SIZE);
     }
 
+    elf_compact_patch_layout patch = elf_compact_patch;
+    elf_set_rel32(patch.i0_offset32_stub, &patch, entry->symbol.address + entry->endbr64, test_entry->symbol.address);
+    elf_check(elf_set_sym_bytes(entry->symbol.symbol, entry->endbr64, (uint8_t*)&patch, sizeof(patch)));
+    return elf_stack_error(ELF_OK);
+}
+
+static void elf_set_rel8(uint8_t* field, const void* patch, size_t address, size_t target)
+{
+    int8_t offset = target - (address + (field + 1 - (const uint8_t*)patch));
+    memcpy(field, &offset, sizeof(offset));
+}
+
+static int elf_prefix_fits(const elf_func_table* table, size_t index, size_t prefix_size)
+{
+    // both short jumps must reach: back to the stub, and from the stub to the body.
+    size_t entry_to_stub = table->endbr64[index] + sizeof(elf_prefix_patch_layout) + prefix_size;
+    size_t stub_to_body = table->endbr64[index] + table->padding[index];
+    return table->prefix[index] >= prefix_size && entry_to_stub <= 128 && stub_to_body <= 127;
+}
+
+static int elf_patch_function_prefix(const elf_func_table* table, size_t index, elf_patch_chunk* chunk)
+{
+    size_t function;
+    elf_check(elf_get_sym_address(table->symbol[index], &function));
+    size_t site = function + table->endbr64[index];
+    size_t body = site + table->padding[index];
+
+    // the stub ends right at the symbol, unused prefix nops stay in front of it.
+    size_t stub_address = function - sizeof(elf_prefix_stub_layout);
+    const elf_patch_plan* plan = chunk->plan;
+    elf_prefix_stub_layout stub = elf_prefix_stub;
+    elf_set_rel32(stub.i0_offset32_slot, &stub, stub_address, plan->slots + plan->slot[index] * sizeof(gt_mock_slot));
+    elf_set_rel8(stub.i2_offset8_body, &stub, stub_address, body);
+    elf_check(elf_set_file_bytes(table->offset[index] - sizeof(stub), (uint8_t*)&stub, sizeof(stub)));
+
+    elf_prefix_patch_layout patch = elf_prefix_patch;
+    elf_set_rel8(patch.i0_offset8_stub, &patch, site, stub_address);
+    elf_check(elf_set_sym_bytes(table->symbol[index], table->endbr64[index], (uint8_t*)&patch, sizeof(patch)));
     return elf_stack_error(ELF_OK);
 }
 
-static int elf_patch_function(elf_function_info* function, elf_symbol_info* hijack, elf_symbol_info* mock)
+static int elf_patch_entrypoint_prefix(const elf_func_table* table, size_t index, elf_function_info* test_entry)
 {
-    static uint8_t* patch_start = (uint8_t*)&elf_mock_patch.i0_nop[0];
-    static int32_t* hijack_ptr = (int32_t*)&elf_mock_patch.i1_offset32_hijack[0];
-    static int32_t* mock_ptr = (int32_t*)&elf_mock_patch.i7_offset32_mock[0];
+    // the entry point jumps back to a tail jump to gt_test_main.
+    if (!elf_prefix_fits(table, index, sizeof(elf_compact_patch_layout))) {
+        puts("Prefix or padding too small to patch the entry point.");
+        return elf_stack_error(ELF_ERR_INVALID_SIZE);
+    }
+
+    size_t function;
+    elf_check(elf_get_sym_address(table->symbol[index], &function));
+    size_t site = function + table->endbr64[index];
+
+    size_t jump_address = function - sizeof(elf_compact_patch_layout);
+    elf_compact_patch_layout jump = elf_compact_patch;
+    elf_set_rel32(jump.i0_offset32_stub, &jump, jump_address, test_entry->symbol.address);
+    elf_check(elf_set_file_bytes(table->offset[index] - sizeof(jump), (uint8_t*)&jump, sizeof(jump)));
+
+    elf_prefix_patch_layout patch = elf_prefix_patch;
+    elf_set_rel8(patch.i0_offset8_stub, &patch, site, jump_address);
+    elf_check(elf_set_sym_bytes(table->symbol[index], table->endbr64[index], (uint8_t*)&patch, sizeof(patch)));
+    return elf_stack_error(ELF_OK);
+}
 
-    if (function->padding < 50) {
-        printf("Padding too small (%lu bytes) to patch function.\n", function->padding);
+static int elf_disarm_site(const elf_func_table* table, size_t index, const elf_patch_plan* plan)
+{
+    size_t function;
+    elf_check(elf_get_sym_address(table->symbol[index], &function));
+    size_t site = function + table->endbr64[index];
+    size_t body = site + table->padding[index];
+
+    uint8_t* armed;
+    elf_check(elf_offset(table->offset[index] + table->endbr64[index], sizeof(uint16_t), (void**)&armed));
+    gt_patch_toggle* toggle = &plan->toggles[plan->slot[index]];
+    toggle->entry = table->endbr64[index];
+    memcpy(&toggle->armed, armed, sizeof(toggle->armed));
+    toggle->disarmed = toggle->armed;
+
+    // the runtime swaps both bytes with one aligned store, and the short jump
+    // must reach the body; other sites stay armed.
+    if ((site & 7) == 7 || body - (site + sizeof(elf_prefix_patch_layout)) > 127) {
         return elf_stack_error(ELF_OK);
     }
 
-    int32_t offset;
+    elf_prefix_patch_layout jump = elf_prefix_patch;
+    elf_set_rel8(jump.i0_offset8_stub, &jump, site, body);
+    memcpy(&toggle->disarmed, &jump, sizeof(toggle->disarmed));
+    elf_check(elf_set_sym_bytes(table->symbol[index], table->endbr64[index], (uint8_t*)&jump, sizeof(jump)));
+    return elf_stack_error(ELF_OK);
+}
+
+static elf_site_kind elf_patch_site_kind(const elf_patch_chunk* chunk, size_t index)
+{
+    const elf_func_table* table = chunk->table;
+
+    // aliases share an offset, they must not be patched a second time.
+    if (table->size[index] != 0 && table->offset[index] == chunk->gtmain) {
+        return ELF_SITE_TEST_ENTRY;
+    } else if (table->size[index] != 0 && table->offset[index] == chunk->entry) {
+        return ELF_SITE_PROGRAM_ENTRY;
+    } else if (table->padding[index] < elf_patch_min_padding[chunk->mode]) {
+        return ELF_SITE_TOO_SMALL;
+    } else if (chunk->mode == ELF_PATCH_PREFIX && !elf_prefix_fits(table, index, sizeof(elf_prefix_stub_layout))) {
+        return ELF_SITE_TOO_SMALL;
+    }
+    return ELF_SITE_PATCH;
+}
+
+static int elf_patch_range(elf_patch_chunk* chunk)
+{
+    const elf_func_table* table = chunk->table;
 
-    offset = function->symbol.offset + function->endbr64 + (uint8_t*)(hijack_ptr + 1) - (uint8_t*)&elf_mock_patch;
-    *hijack_ptr = hijack->offset - offset;
+    for (size_t i = chunk->begin; i < chunk->end; i++) {
+        const char* name = table->name[i];
+        uint8_t state = ELF_FUNC_ENTRY;
 
-    offset = function->symbol.offset + function->endbr64 + (uint8_t*)(mock_ptr + 1) - (uint8_t*)&elf_mock_patch;
-    *mock_ptr = mock->offset - offset;
+        if (chunk->verbose) {
+            elf_print_divider(name, strlen(name));
+        }
+
+        switch (chunk->plan->kind[i]) {
+        case ELF_SITE_TEST_ENTRY:
+            if (chunk->verbose) {
+                puts("test entry point.");
+            }
+            break;
+        case ELF_SITE_PROGRAM_ENTRY:
+            if (chunk->verbose) {
+                puts("program entry point.");
+            }
+            break;
+        case ELF_SITE_TOO_SMALL:
+            if (chunk->verbose && chunk->mode == ELF_PATCH_PREFIX) {
+                printf("prefix size less than %zu bytes or padding size less than %u bytes; skipping.\n",
+                    sizeof(elf_prefix_stub_layout), elf_patch_min_padding[chunk->mode]);
+            } else if (chunk->verbose) {
+                printf("padding size less than %u bytes; skipping.\n", elf_patch_min_padding[chunk->mode]);
+            }
+            chunk->stats.skipped++;
+            state = ELF_FUNC_SKIPPED;
+            break;
+        case ELF_SITE_PATCH:
+            if (chunk->mode == ELF_PATCH_COMPACT) {
+                elf_check(elf_patch_function_compact(table, i, chunk));
+            } else if (chunk->mode == ELF_PATCH_PREFIX) {
+                elf_check(elf_patch_function_prefix(table, i, chunk));
+            } else {
+                elf_check(elf_patch_function(table, i, chunk->plan));
+            }
+            elf_check(elf_disarm_site(table, i, chunk->plan));
+            if (chunk->verbose) {
+                size_t size = (chunk->mode == ELF_PATCH_COMPACT) ? sizeof(elf_compact_patch)
+                    : (chunk->mode == ELF_PATCH_PREFIX)          ? sizeof(elf_prefix_patch)
+                                                                 : sizeof(elf_mock_patch);
+                printf("wrote %zu bytes at offset %zx.\n", size, table->offset[i] + table->endbr64[i]);
+            }
+            chunk->stats.patched++;
+            state = ELF_FUNC_PATCHED;
+            break;
+        case ELF_SITE_ALIAS:
+            if (chunk->verbose) {
+                puts("alias of a patched function.");
+            }
+            chunk->stats.patched++;
+            state = ELF_FUNC_PATCHED;
+            break;
+        }
+
+        if (chunk->manifest != NULL) {
+            chunk->manifest[i].state = state;
+        }
+    }
 
-    elf_check(elf_set_sym_bytes(function->symbol.symbol, function->endbr64, (uint8_t*)&elf_mock_patch, sizeof(elf_mock_patch)));
     return elf_stack_error(ELF_OK);
 }
 
-static int elf_patch_entrypoint(elf_function_info* entry, elf_function_info* test_entry)
+static void* elf_patch_worker(void* arg)
+{
+    elf_patch_chunk* chunk = arg;
+    elf_bind_context(chunk->context);
+    chunk->error = elf_patch_range(chunk);
+    return NULL;
+}
+
+static size_t elf_patch_worker_num(size_t length, int verbose, size_t threads)
+{
+    // verbose output is only readable in table order.
+    if (verbose) {
+        return 1;
+    }
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (online > 0) ? online : 1;
+    }
+
+    size_t useful = (length + ELF_PATCH_CHUNK_MIN - 1) / ELF_PATCH_CHUNK_MIN;
+    threads = (threads < useful) ? threads : useful;
+    threads = (threads < ELF_PATCH_MAX_THREADS) ? threads : ELF_PATCH_MAX_THREADS;
+    return (threads > 0) ? threads : 1;
+}
+
+static int elf_compare_sites(const void* a, const void* b)
+{
+    const elf_patch_site* x = a;
+    const elf_patch_site* y = b;
+    if (x->address != y->address) {
+        return (x->address > y->address) - (x->address < y->address);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static void elf_free_plan(elf_patch_plan* plan)
 {
-    static uint8_t* patch_start = (uint8_t*)&elf_main_patch.i0_push_rbp[0];
-    static int32_t* test_entry_ptr = (int32_t*)&elf_main_patch.i3_offset32_main[0];
+    free(plan->kind);
+    free(plan->slot);
+    free(plan->site);
+    *plan = (elf_patch_plan) { 0 };
+}
 
-    int32_t offset = entry->symbol.offset + entry->endbr64 + (uint8_t*)(test_entry_ptr + 1) - (uint8_t*)patch_start;
-    *test_entry_ptr = test_entry->symbol.offset - offset;
+static int elf_plan_sites(const elf_patch_chunk* chunk, elf_patch_plan* plan)
+{
+    const elf_func_table* table = chunk->table;
+    plan->kind = malloc(table->length + 1);
+    plan->slot = calloc(table->length + 1, sizeof(*plan->slot));
+    plan->site = malloc((table->length + 1) * sizeof(*plan->site));
+    if (plan->kind == NULL || plan->slot == NULL || plan->site == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
 
-    elf_check(elf_set_sym_bytes(entry->symbol.symbol, entry->endbr64, (uint8_t*)&elf_main_patch, sizeof(elf_main_patch)));
+    // aliases share their bytes with another entry, possibly of another chunk:
+    // every entry is hashed before any worker writes.
+    if (chunk->manifest != NULL) {
+        elf_check(elf_hash_manifest(table, chunk->manifest));
+    }
+
+    size_t site_num = 0;
+    for (size_t i = 0; i < table->length; i++) {
+        plan->kind[i] = elf_patch_site_kind(chunk, i);
+        if (plan->kind[i] == ELF_SITE_PATCH) {
+            plan->site[site_num].index = i;
+            elf_check(elf_get_sym_address(table->symbol[i], &plan->site[site_num++].address));
+        }
+    }
+
+    // aliases share an address: the first one in table order is patched and owns
+    // the slot, the others only point to it.
+    qsort(plan->site, site_num, sizeof(*plan->site), elf_compare_sites);
+    for (size_t k = 0; k < site_num; k++) {
+        size_t index = plan->site[k].index;
+        if (plan->slot_num > 0 && plan->site[plan->slot_num - 1].address == plan->site[k].address) {
+            plan->kind[index] = ELF_SITE_ALIAS;
+            plan->slot[index] = plan->slot_num - 1;
+        } else {
+            plan->site[plan->slot_num] = plan->site[k];
+            plan->slot[index] = plan->slot_num++;
+        }
+    }
     return elf_stack_error(ELF_OK);
 }
 
-static int elf_patch_elf_impl(const char* entrypoint, int verbose)
+static int elf_alloc_slots(Elf64_Shdr* section, elf_patch_mode mode, elf_patch_plan* plan)
 {
+    if (plan->slot_num == 0) {
+        return elf_stack_error(ELF_OK);
+    }
+
+    Elf64_Sym* descriptor_sym;
+    elf_ro_bytebuff bytes;
+    size_t size;
+    gt_patch_descriptor descriptor = { 0 };
+    elf_check(elf_get_sym_wname(section, gt_patch_table_symbol_name(), &descriptor_sym));
+    elf_check(elf_get_readonly_sym_bytes(descriptor_sym, &bytes, &size));
+    if (size >= sizeof(descriptor)) {
+        memcpy(&descriptor, bytes, sizeof(descriptor));
+    }
+
+    if (descriptor.magic != GT_PATCH_TABLE_MAGIC) {
+        puts("gt_patch_table does not match the patcher, gt.o must be rebuilt.");
+        return elf_stack_error(ELF_ERR_ELF);
+    }
+
+    size_t table_address;
+    elf_check(elf_get_sym_address(descriptor_sym, &table_address));
+
+    // slots are zeroed memory at the end of the bss; the segment that holds the
+    // stubs, the site table and the site toggles is appended after it.
+    elf_check(elf_extend_bss(plan->slot_num * sizeof(gt_mock_slot), sizeof(gt_mock_slot), &plan->slots));
+
+    size_t stubs_size = (mode == ELF_PATCH_COMPACT) ? plan->slot_num * sizeof(elf_compact_stub_layout) : 0;
+    size_t sites_size = plan->slot_num * sizeof(int64_t);
+    size_t toggles_size = plan->slot_num * sizeof(gt_patch_toggle);
+    Elf64_Word flags = (mode == ELF_PATCH_COMPACT) ? PF_R | PF_X : PF_R;
+    Elf64_Addr address;
+    elf_bytebuffer buf;
+    elf_check(elf_append_segment(stubs_size + sites_size + toggles_size, flags, &address, &buf));
+    plan->stubs = buf;
+    plan->stub_address = address;
+    plan->toggles = (gt_patch_toggle*)(buf + stubs_size + sites_size);
+
+    // offsets from gt_patch_table do not depend on where the executable is loaded.
+    int64_t* sites = (int64_t*)(buf + stubs_size);
+    for (size_t k = 0; k < plan->slot_num; k++) {
+        sites[k] = (int64_t)(plan->site[k].address - table_address);
+    }
+
+    descriptor.sites = (int64_t)(address + stubs_size - table_address);
+    descriptor.slots = (int64_t)(plan->slots - table_address);
+    descriptor.toggles = (int64_t)(address + stubs_size + sites_size - table_address);
+    descriptor.count = plan->slot_num;
+    elf_check(elf_set_sym_bytes(descriptor_sym, 0, (elf_bytebuffer)&descriptor, sizeof(descriptor)));
+    return elf_stack_error(ELF_OK);
+}
+
+static int elf_patch_elf_impl(const char* entrypoint, const elf_patch_options* options, elf_patch_stats* stats_ref, elf_manifest* manifest_ref)
+{
+    if (options->mode != ELF_PATCH_INLINE && options->mode != ELF_PATCH_COMPACT && options->mode != ELF_PATCH_PREFIX) {
+        return elf_stack_error(ELF_ERR_OPTION);
+    }
+
     elf_check(elf_check_elf_type());
 
     Elf64_Shdr* section;
-    Elf64_Sym* hijack_sym;
-    Elf64_Sym* mock_sym;
     Elf64_Sym* gtmain_sym;
     Elf64_Sym* entry_sym;
-    elf_index_iterator it;
+    const elf_func_table* table;
 
     elf_check(elf_get_sym_shdr(&section));
-    elf_check(elf_get_sym_wname(section, gt_function_hijack_symbol_name(), &hijack_sym));
-    elf_check(elf_get_sym_wname(section, gt_function_mock_symbol_name(), &mock_sym));
     elf_check(elf_get_sym_wname(section, gt_function_main_symbol_name(), &gtmain_sym));
     elf_check(elf_get_sym_wname(section, entrypoint, &entry_sym));
+    elf_check(elf_get_func_table(&table));
 
-    elf_symbol_info hijack = { 0 };
-    elf_symbol_info mock = { 0 };
     elf_function_info entryptn = { 0 };
     elf_function_info gtmain = { 0 };
-    elf_function_info func = { 0 };
 
-    elf_check(elf_load_symbol_info(section, hijack_sym, &hijack));
-    elf_check(elf_load_symbol_info(section, mock_sym, &mock));
     elf_check(elf_load_function_info(section, gtmain_sym, &gtmain));
     elf_check(elf_load_function_info(section, entry_sym, &entryptn));
-    elf_check(elf_reset_index_iterator(&it));
 
-    // patch entry point
-    elf_check(elf_patch_entrypoint(&entryptn, &gtmain));
+    if (manifest_ref != NULL) {
+        elf_check(elf_alloc_manifest(table->length, manifest_ref));
+    }
 
-    int skipped = 0;
-    int patched = 0;
-    int error;
-    while ((error = elf_get_sym_wtype(section, STT_FUNC, &it)) == ELF_OK) {
-        elf_check(elf_load_function_info(section, it.object, &func));
+    // every function patch only depends on the plan, the table is split in
+    // contiguous chunks patched independently.
+    elf_patch_plan plan = { 0 };
+    size_t workers = elf_patch_worker_num(table->length, options->verbose, options->threads);
+    elf_patch_chunk chunks[ELF_PATCH_MAX_THREADS];
+    pthread_t handles[ELF_PATCH_MAX_THREADS];
+    int started[ELF_PATCH_MAX_THREADS] = { 0 };
+
+    for (size_t w = 0; w < workers; w++) {
+        chunks[w] = (elf_patch_chunk) {
+            .context = elf_current_context(),
+            .table = table,
+            .begin = table->length * w / workers,
+            .end = table->length * (w + 1) / workers,
+            .gtmain = gtmain.symbol.offset,
+            .entry = entryptn.symbol.offset,
+            .verbose = options->verbose,
+            .mode = options->mode,
+            .plan = &plan,
+            .manifest = (manifest_ref != NULL) ? manifest_ref->entry : NULL,
+        };
+    }
 
-        if (verbose) {
-            elf_print_divider(func.symbol.name, func.symbol.name_length);
-        }
+    int error = elf_plan_sites(&chunks[0], &plan);
+    if (error == ELF_OK) {
+        error = elf_alloc_slots(section, options->mode, &plan);
+    }
 
-        if (strcmp(gtmain.symbol.name, func.symbol.name) == 0) {
-            if (verbose) {
-                puts("test entry point.");
-            }
-        } else if (strcmp(entryptn.symbol.name, func.symbol.name) == 0) {
-            if (verbose) {
-                puts("program entry point.");
-            }
-        } else if (func.padding < 50) {
-            if (verbose) {
-                puts("padding size less than 50 bytes; skipping.");
-            }
-            skipped++;
+    // lazily built tables must exist before workers read them.
+    if (error == ELF_OK) {
+        error = elf_build_segment_table();
+    }
+    if (error != ELF_OK) {
+        elf_free_plan(&plan);
+        elf_free_manifest(manifest_ref);
+        return elf_stack_error(error);
+    }
+
+    for (size_t w = 1; w < workers; w++) {
+        started[w] = pthread_create(&handles[w], NULL, elf_patch_worker, &chunks[w]) == 0;
+    }
+
+    // the calling thread takes the first chunk, and any chunk whose thread could not start.
+    chunks[0].error = elf_patch_range(&chunks[0]);
+    for (size_t w = 1; w < workers; w++) {
+        if (started[w]) {
+            pthread_join(handles[w], NULL);
         } else {
-            elf_check(elf_patch_function(&func, &hijack, &mock));
-            if (verbose) {
-                printf("wrote %zu bytes at offset %zx.\n", sizeof(elf_mock_patch), func.symbol.offset + func.endbr64);
-            }
-            patched++;
+            chunks[w].error = elf_patch_range(&chunks[w]);
+        }
+    }
+
+    elf_patch_stats stats = { 0 };
+    for (size_t w = 0; w < workers; w++) {
+        error = (error != ELF_OK) ? error : chunks[w].error;
+        stats.patched += chunks[w].stats.patched;
+        stats.skipped += chunks[w].stats.skipped;
+    }
+
+    // the program entry point is patched once every function is.
+    if (error == ELF_OK && options->mode == ELF_PATCH_COMPACT) {
+        error = elf_patch_entrypoint_compact(&entryptn, &gtmain);
+    } else if (error == ELF_OK && options->mode == ELF_PATCH_PREFIX) {
+        size_t entry_index = 0;
+        while (entry_index < table->length && table->symbol[entry_index] != entry_sym) {
+            entry_index++;
         }
+        error = (entry_index < table->length) ? elf_patch_entrypoint_prefix(table, entry_index, &gtmain) : ELF_ERR_NOT_FOUND;
+    } else if (error == ELF_OK) {
+        error = elf_patch_entrypoint(&entryptn, &gtmain);
+    }
+
+    elf_free_plan(&plan);
+    if (error != ELF_OK) {
+        elf_free_manifest(manifest_ref);
+        return elf_stack_error(error);
+    }
+
+    if (stats_ref != NULL) {
+        *stats_ref = stats;
+    }
+    return elf_stack_error(ELF_OK);
+}
 
-        //     // elf offset of next instruction for hijack and hook symbols
-        //     size_t elf_hijack_nxinst_offset
-        //     = +fn_info.endbr64_offset;
-        // size_t elf_hook_nxinst_offset = fn_info.elf_offset + hook_nxinst_offset + fn_info.endbr64_offset;
-        //
-        // // distance from next instruction to elf offset of hijack and hook symbols
-        // uint32_t elf_hijack_func_distance = hijack_symbol_offset - elf_hijack_nxinst_offset;
-        // uint32_t elf_hook_func_distance = hook_symbol_offset - elf_hook_nxinst_offset;
-
-        // pointer in patch for distance from next instruction to elf offset of hijack and hook symbols
-        // uint8_t* patch_hijack_bytes = &elf_mock_patch[hijack_patch_offset];
-        // uint8_t* patch_hook_bytes = &elf_mock_patch[hook_patch_offset];
-        // memcpy(patch_hijack_bytes, &elf_hijack_func_distance, sizeof(uint32_t));
-        // memcpy(patch_hook_bytes, &elf_hook_func_distance, sizeof(uint32_t));
-        //
-        // // WRITE PATCH
-        // elf_check(elf_set_sym_bytes(fn_info.symbol, fn_info.endbr64_offset, elf_mock_patch, sizeof(elf_mock_patch)));
-        // elf_check(elf_print_sym_bytes(fn_info.symbol, fn_info.instructions, fn_info.instructions_size));
-    }
-
-    // set initial mock to gt_test_main, to hijack main and
-    // redirect execution to gt_test_main.
-    // if (main_info.symbol && test_main_info.symbol) {
-    //
-    //     size_t elf_main_nxinst_offset = main_info.elf_offset + main_nxinst_offset + main_info.endbr64_offset;
-    //     uint32_t elf_main_func_distance = test_main_info.elf_offset - elf_main_nxinst_offset;
-    //     uint8_t* patch_main_bytes = &elf_main_patch[]
-    //
-    //                                 elf_check(elf_set_sym_bytes(hijack_symbol, 0, (elf_bytebuffer)&main_offset, sizeof(main_offset)));
-    //     elf_check(elf_set_sym_bytes(hook_symbol, 0, (elf_bytebuffer)&test_main_offset, sizeof(test_main_offset)));
-    //
-    //     elf_update_divider(divider, divider_length, "hijack", sizeof("hijack") - 1);
-    //     elf_print_sym_bytes_2(hijack_symbol);
-    //     elf_update_divider(divider, divider_length, "hook", sizeof("hook") - 1);
-    //     elf_print_sym_bytes_2(hook_symbol);
-    // }
-
-    printf("\n\nPatched: %i\nSkipped: %i\n", patched, skipped);
+int elf_patch_elf_wthreads(const char* entrypoint, int verbose, size_t threads, elf_patch_stats* stats_ref)
+{
+    elf_patch_options options = { .verbose = verbose, .threads = threads, .mode = ELF_PATCH_INLINE };
+    elf_check(elf_patch_elf_impl(entrypoint, &options, stats_ref, NULL));
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_patch_elf_wmanifest(const char* entrypoint, int verbose, size_t threads, elf_patch_stats* stats_ref, elf_manifest* manifest_ref)
+{
+    if (manifest_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    elf_patch_options options = { .verbose = verbose, .threads = threads, .mode = ELF_PATCH_INLINE };
+    elf_check(elf_patch_elf_impl(entrypoint, &options, stats_ref, manifest_ref));
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_patch_elf_woptions(const char* entrypoint, const elf_patch_options* options, elf_patch_stats* stats_ref, elf_manifest* manifest_ref)
+{
+    if (options == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    elf_check(elf_patch_elf_impl(entrypoint, options, stats_ref, manifest_ref));
     return elf_stack_error(ELF_OK);
 }
 
 int elf_patch_elf(const char* entrypoint, int verbose)
 {
-    elf_check(elf_patch_elf_impl(entrypoint, verbose));
+    elf_patch_stats stats;
+    elf_patch_options options = { .verbose = verbose, .mode = ELF_PATCH_INLINE };
+    elf_check(elf_patch_elf_impl(entrypoint, &options, &stats, NULL));
+    printf("\n\nPatched: %zu\nSkipped: %zu\n", stats.patched, stats.skipped);
+    return elf_stack_error(ELF_OK);
+}
+
+int elf_patch_mode_wname(const char* name, elf_patch_mode* mode_ref)
+{
+    if (mode_ref == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    if (name == NULL || strcmp(name, "inline") == 0) {
+        *mode_ref = ELF_PATCH_INLINE;
+    } else if (strcmp(name, "compact") == 0) {
+        *mode_ref = ELF_PATCH_COMPACT;
+    } else if (strcmp(name, "prefix") == 0) {
+        *mode_ref = ELF_PATCH_PREFIX;
+    } else {
+        return elf_stack_error(ELF_ERR_OPTION);
+    }
+    return elf_stack_error(ELF_OK);
+}
+
+typedef struct {
+    uintptr_t base;
+    Elf64_Addr start;
+    Elf64_Addr end;
+} elf_self_image;
+
+static int elf_find_self_image(struct dl_phdr_info* info, size_t size, void* arg)
+{
+    // the executable is listed first.
+    elf_self_image* image = arg;
+    image->base = info->dlpi_addr;
+    image->start = UINT64_MAX;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const Elf64_Phdr* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && phdr->p_vaddr < image->start) {
+            image->start = phdr->p_vaddr;
+        }
+        if (phdr->p_type == PT_LOAD && phdr->p_vaddr + phdr->p_memsz > image->end) {
+            image->end = phdr->p_vaddr + phdr->p_memsz;
+        }
+    }
+    return 1;
+}
+
+// every function may get a slot, a compact stub, a site and a toggle; the
+// segment alignment is paid once for the bss and once for the appended segment.
+static int elf_self_area_size(size_t* size_ref)
+{
+    Elf64_Ehdr* hdr;
+    const elf_func_table* table;
+    elf_check(elf_get_hdr(&hdr));
+    elf_check(elf_get_func_table(&table));
+
+    size_t align = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr* phdr;
+        elf_check(elf_get_phdr_windex(i, &phdr));
+        if (phdr->p_type == PT_LOAD && phdr->p_align > align) {
+            align = phdr->p_align;
+        }
+    }
+
+    size_t function = sizeof(gt_mock_slot) + sizeof(elf_compact_stub_layout) + sizeof(int64_t) + sizeof(gt_patch_toggle);
+    *size_ref = table->length * function + 3 * align;
+    return elf_stack_error(ELF_OK);
+}
+
+// the highest free range of /proc/self/maps that every byte of the image
+// reaches with a rel32 displacement; the heap right after the image is avoided.
+static int elf_find_self_area(const elf_self_image* image, size_t size, Elf64_Addr* vaddr_ref)
+{
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        return elf_stack_error(ELF_ERR_PATH);
+    }
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t floor = (image->base + image->end + page - 1) & ~(page - 1);
+    uintptr_t limit = image->base + image->start + INT32_MAX - size;
+    uintptr_t previous = 0;
+    uintptr_t found = 0;
+    unsigned long low;
+    unsigned long high;
+    while (fscanf(maps, "%lx-%lx%*[^\n]", &low, &high) == 2) {
+        uintptr_t gap = (previous > floor) ? previous : floor;
+        uintptr_t candidate = ((low - size < limit) ? low - size : limit) & ~(page - 1);
+        if (low >= size && low > gap && candidate >= gap) {
+            found = candidate;
+        }
+        previous = high;
+    }
+    fclose(maps);
+
+    if (found == 0) {
+        puts("No free memory within reach of the executable for the slots and stubs.");
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    *vaddr_ref = found - image->base;
     return elf_stack_error(ELF_OK);
 }
+
+int elf_patch_self(const char* entrypoint, const elf_patch_options* options, elf_patch_stats* stats_ref)
+{
+    if (entrypoint == NULL || options == NULL) {
+        return elf_stack_error(ELF_ERR_NULL);
+    }
+
+    elf_self_image image = { 0 };
+    dl_iterate_phdr(elf_find_self_image, &image);
+
+    // patched on its own context: the caller may have an ELF loaded.
+    elf_context* previous = elf_current_context();
+    elf_context* context;
+    elf_check(elf_create_context(&context));
+    elf_bind_context(context);
+
+    size_t area_size = 0;
+    Elf64_Addr area = 0;
+    int error = elf_load_elf("/proc/self/exe");
+    if (error == ELF_OK) {
+        error = elf_self_area_size(&area_size);
+    }
+    if (error == ELF_OK) {
+        error = elf_find_self_area(&image, area_size, &area);
+    }
+    if (error == ELF_OK) {
+        error = elf_set_append_vaddr(area);
+    }
+    if (error == ELF_OK) {
+        error = elf_patch_elf_impl(entrypoint, options, stats_ref, NULL);
+    }
+    if (error == ELF_OK) {
+        error = elf_apply_elf(image.base, image.end);
+    }
+
+    elf_bind_context(previous);
+    elf_destroy_context(context);
+    return elf_stack_error(error);
+}
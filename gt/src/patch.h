@@ -2,4 +2,39 @@
     Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
 */
 
+#pragma once
+#include "manifest.h"
+#include <stddef.h>
+
+// bumped whenever the patched bytes change for the same input.
+#define ELF_PATCH_LAYOUT_VERSION 5
+
+typedef struct {
+    size_t patched;
+    size_t skipped;
+} elf_patch_stats;
+
+typedef enum {
+    ELF_PATCH_INLINE,
+    ELF_PATCH_COMPACT,
+    ELF_PATCH_PREFIX,
+} elf_patch_mode;
+
+typedef struct {
+    int verbose;
+    size_t threads;
+    elf_patch_mode mode;
+} elf_patch_options;
+
 int elf_patch_elf(const char* entrypoint, int verbose);
+
+int elf_patch_elf_wthreads(const char* entrypoint, int verbose, size_t threads, elf_patch_stats* stats_ref);
+
+int elf_patch_elf_wmanifest(const char* entrypoint, int verbose, size_t threads, elf_patch_stats* stats_ref, elf_manifest* manifest_ref);
+
+int elf_patch_elf_woptions(const char* entrypoint, const elf_patch_options* options, elf_patch_stats* stats_ref, elf_manifest* manifest_ref);
+
+int elf_patch_mode_wname(const char* name, elf_patch_mode* mode_ref);
+
+// patches the running executable in memory, from a copy of /proc/self/exe.
+int elf_patch_self(const char* entrypoint, const elf_patch_options* options, elf_patch_stats* stats_ref);
@@ -0,0 +1,30 @@
+/*
+    Copyright (c) 2026 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
+*/
+
+#include "lib.h"
+#include "patch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// GT_SELF_PATCH=<entry point> patches the test executable in memory before
+// main runs, instead of rewriting it with cli.elf. linked in gt.o only.
+__attribute__((constructor)) static void gt_self_patch(void)
+{
+    const char* entry = getenv("GT_SELF_PATCH");
+    if (entry == NULL || entry[0] == '\0') {
+        return;
+    }
+
+    elf_patch_options options = { 0 };
+    if (elf_patch_mode_wname(getenv("GT_PATCH_MODE"), &options.mode) != ELF_OK) {
+        puts("GT_PATCH_MODE: expected inline, compact or prefix.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (elf_patch_self(entry, &options, NULL) != ELF_OK) {
+        puts("GT_SELF_PATCH: could not patch the executable in memory.");
+        elf_print_error_trace();
+        exit(EXIT_FAILURE);
+    }
+}
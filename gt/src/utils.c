@@ -2,10 +2,15 @@
     Copyright (c) 2025 Gaël Fortier <gael.fortier.1@ens.etsmtl.ca>
 */
 
+#define _GNU_SOURCE
 #include "utils.h"
 #include "lib.h"
 #include <ctype.h>
+#include <errno.h>
+#include <linux/fs.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 int elf_tokenize(char* text, size_t max_tok, char** tokens, int* tok_num)
 {
@@ -17,7 +22,7 @@ int elf_tokenize(char* text, size_t max_tok, char** tokens, int* tok_num)
     char* token = NULL;
 
     *tok_num = 0;
-    while ((token = strtok(src, " \n")) && *tok_num < max_tok) {
+    while ((token = strtok(src, " \t\r\n")) && *tok_num < max_tok) {
         src = NULL;
         tokens[*tok_num] = token;
         (*tok_num)++;
@@ -100,3 +105,92 @@ int elf_hexstr_tobyte(const char* text, uint8_t* byte_ref)
     int result = sscanf(text, "%hhx", byte_ref);
     return elf_stack_error((result == 0) ? ELF_ERR_NOT_NUMBER : ELF_OK);
 }
+
+int elf_copy_fd(int src_fd, int dst_fd, size_t size)
+{
+    // reflink first: shares extents on btrfs/xfs, nothing is copied.
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        return elf_stack_error(ELF_OK);
+    }
+
+    // in-kernel copy, no round trip through user space.
+    loff_t src_offset = 0;
+    loff_t dst_offset = 0;
+    while ((size_t)src_offset < size) {
+        ssize_t result = copy_file_range(src_fd, &src_offset, dst_fd, &dst_offset, size - src_offset, 0);
+        if (result <= 0) {
+            break;
+        }
+    }
+
+    if ((size_t)src_offset == size) {
+        return elf_stack_error(ELF_OK);
+    }
+
+    // plain read/write for whatever copy_file_range could not handle.
+    static const size_t chunk = 1 << 20;
+    uint8_t* buffer = malloc(chunk);
+    if (buffer == NULL) {
+        return elf_stack_error(ELF_ERR_MALLOC);
+    }
+
+    while ((size_t)src_offset < size) {
+        size_t length = (size - src_offset < chunk) ? size - src_offset : chunk;
+        ssize_t result = pread(src_fd, buffer, length, src_offset);
+        if (result <= 0 || pwrite(dst_fd, buffer, result, src_offset) != result) {
+            free(buffer);
+            return elf_stack_error(ELF_ERR_WRITE);
+        }
+        src_offset += result;
+    }
+
+    free(buffer);
+    return elf_stack_error(ELF_OK);
+}
+
+static uint64_t elf_hash_round(uint64_t acc, uint64_t value)
+{
+    acc += value * 0xc2b2ae3d27d4eb4full;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * 0x9e3779b185ebca87ull;
+}
+
+static uint64_t elf_hash_final(uint64_t hash)
+{
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+void elf_hash_bytes(const void* data, size_t size, uint64_t seed, uint64_t hash_ref[2])
+{
+    // four independent lanes so the multiplies of a block overlap.
+    const uint8_t* bytes = data;
+    uint64_t lane[4] = {
+        seed + 0x9e3779b185ebca87ull,
+        seed ^ 0xc2b2ae3d27d4eb4full,
+        seed - 0x165667b19e3779f9ull,
+        ~seed,
+    };
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        uint64_t block[4];
+        memcpy(block, bytes + i, sizeof(block));
+        lane[0] = elf_hash_round(lane[0], block[0]);
+        lane[1] = elf_hash_round(lane[1], block[1]);
+        lane[2] = elf_hash_round(lane[2], block[2]);
+        lane[3] = elf_hash_round(lane[3], block[3]);
+    }
+
+    uint64_t block[4] = { 0 };
+    memcpy(block, bytes + i, size - i);
+    for (int k = 0; k < 4; k++) {
+        lane[k] = elf_hash_round(lane[k], block[k] ^ size);
+    }
+
+    hash_ref[0] = elf_hash_final(lane[0] ^ ((lane[2] << 17) | (lane[2] >> 47)));
+    hash_ref[1] = elf_hash_final(lane[1] ^ ((lane[3] << 29) | (lane[3] >> 35)) ^ hash_ref[0]);
+}
@@ -23,3 +23,7 @@ int elf_print_cmdent_list(elf_cmdent* list, size_t size);
 int elf_text_isnum(const char* text, long* number);
 
 int elf_hexstr_tobyte(const char* text, uint8_t* byte_ref);
+
+int elf_copy_fd(int src_fd, int dst_fd, size_t size);
+
+void elf_hash_bytes(const void* data, size_t size, uint64_t seed, uint64_t hash_ref[2]);